@@ -0,0 +1,121 @@
+#include "BleConnPolicy.h"
+
+#if BLE_CONN_POLICY_ENABLED
+BleConnPolicy bleConnPolicy;
+#endif
+
+struct ble_conn_params_t {
+  uint16_t minInterval;
+  uint16_t maxInterval;
+  uint16_t latency;
+};
+
+// ble_conn_mode_tの順に並べる
+static const ble_conn_params_t connParams[] = {
+  { BLE_CONN_FAST_MIN_INTERVAL, BLE_CONN_FAST_MAX_INTERVAL, BLE_CONN_FAST_LATENCY },  // BLE_CONN_MODE_LOW_LATENCY
+  { BLE_CONN_IDLE_MIN_INTERVAL, BLE_CONN_IDLE_MAX_INTERVAL, BLE_CONN_IDLE_LATENCY },  // BLE_CONN_MODE_IDLE
+};
+static const char *const connModeNames[] = { "low-latency", "idle" };
+
+void BleConnPolicy::onConnect(uint16_t conn_handle, uint16_t interval, uint16_t latency, uint16_t timeout) {
+  // 新しい接続では低遅延モードから始める
+  this->connHandle = conn_handle;
+  this->connected = true;
+  this->currentMode = BLE_CONN_MODE_LOW_LATENCY;
+  this->needRequest = true;
+  this->waiting = false;
+  this->lastActivityMs = millis();
+  this->mtu = 0;
+  onParams(interval, latency, timeout);
+}
+
+void BleConnPolicy::onDisconnect() {
+  this->connected = false;
+  this->needRequest = false;
+  this->waiting = false;
+  this->connInterval = this->connLatency = this->connTimeout = 0;
+  this->mtu = 0;
+}
+
+void BleConnPolicy::onParams(uint16_t interval, uint16_t latency, uint16_t timeout) {
+  this->connInterval = interval;
+  this->connLatency = latency;
+  this->connTimeout = timeout;
+  ESP_LOGI("BleConnPolicy", "connection interval=%uus latency=%u timeout=%ums",
+           (unsigned)interval * 1250, latency, (unsigned)timeout * 10);
+  _check();
+}
+
+void BleConnPolicy::activity() {
+  this->lastActivityMs = millis();
+  if (this->autoIdle && this->currentMode == BLE_CONN_MODE_IDLE) {
+    this->currentMode = BLE_CONN_MODE_LOW_LATENCY;
+    this->needRequest = true;
+  }
+}
+
+void BleConnPolicy::setMode(ble_conn_mode_t mode, bool autoIdle) {
+  this->autoIdle = autoIdle;
+  this->lastActivityMs = millis();
+  if (mode != this->currentMode) {
+    this->currentMode = mode;
+    this->needRequest = true;
+  }
+}
+
+void BleConnPolicy::_request(ble_conn_mode_t mode) {
+  const ble_conn_params_t &params = connParams[mode];
+  this->server->updateConnParams(this->connHandle, params.minInterval, params.maxInterval,
+                                 params.latency, BLE_CONN_SUPERVISION_TIMEOUT);
+  this->requestCount++;
+  this->requestMs = millis();
+  this->waiting = true;
+  this->needRequest = false;
+  ESP_LOGI("BleConnPolicy", "request %s interval=%u-%u latency=%u",
+           connModeNames[mode], params.minInterval, params.maxInterval, params.latency);
+}
+
+// 要求した範囲に収まれば成立、待ち時間を過ぎても収まらなければ不成立（セントラルの拒否や別の値での決定）
+void BleConnPolicy::_check() {
+  if (!this->waiting) {
+    return;
+  }
+  const ble_conn_params_t &params = connParams[this->currentMode];
+  if (params.minInterval <= this->connInterval && this->connInterval <= params.maxInterval && this->connLatency == params.latency) {
+    this->acceptedCount++;
+    this->waiting = false;
+  } else if (millis() - this->requestMs >= BLE_CONN_UPDATE_WAIT_MS) {
+    this->rejectedCount++;
+    this->waiting = false;
+  }
+}
+
+void BleConnPolicy::poll() {
+  if (this->server == NULL || !this->connected) {
+    return;
+  }
+
+#if BLE_CONN_IDLE_AFTER_MS > 0
+  if (this->autoIdle && this->currentMode == BLE_CONN_MODE_LOW_LATENCY && millis() - this->lastActivityMs >= BLE_CONN_IDLE_AFTER_MS) {
+    this->currentMode = BLE_CONN_MODE_IDLE;
+    this->needRequest = true;
+  }
+#endif
+  if (this->needRequest) {
+    _request(this->currentMode);
+  }
+  _check();
+}
+
+void BleConnPolicy::printStats() const {
+  uint32_t interval_us = (uint32_t)this->connInterval * 1250;
+  Serial.printf("[BLE conn] mode=%s interval=%u.%02ums latency=%u timeout=%ums mtu=%u requests=%u accepted=%u rejected=%u\n",
+                connModeNames[this->currentMode],
+                interval_us / 1000, (interval_us % 1000) / 10,
+                this->connLatency,
+                (uint32_t)this->connTimeout * 10,
+                this->mtu,
+                this->requestCount,
+                this->acceptedCount,
+                this->rejectedCount);
+}
@@ -0,0 +1,101 @@
+#ifndef BLE_CONN_POLICY_H
+#define BLE_CONN_POLICY_H
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+
+// 接続パラメータの設定（build_flagsで上書き可能、間隔は1.25ms単位・タイムアウトは10ms単位）
+#ifndef BLE_CONN_POLICY_ENABLED
+#define BLE_CONN_POLICY_ENABLED 1         // 0なら接続パラメータを要求せず、セントラルの決めた値のまま使う
+#endif
+#ifndef BLE_CONN_FAST_MIN_INTERVAL
+#define BLE_CONN_FAST_MIN_INTERVAL 6      // 低遅延モードの接続間隔の下限（7.5ms）
+#endif
+#ifndef BLE_CONN_FAST_MAX_INTERVAL
+#define BLE_CONN_FAST_MAX_INTERVAL 12     // 低遅延モードの接続間隔の上限（15ms）
+#endif
+#ifndef BLE_CONN_FAST_LATENCY
+#define BLE_CONN_FAST_LATENCY 0           // 低遅延モードのスレーブレイテンシ（毎回の接続イベントに応答する）
+#endif
+#ifndef BLE_CONN_IDLE_MIN_INTERVAL
+#define BLE_CONN_IDLE_MIN_INTERVAL 12     // アイドルモードの接続間隔の下限（15ms）
+#endif
+#ifndef BLE_CONN_IDLE_MAX_INTERVAL
+#define BLE_CONN_IDLE_MAX_INTERVAL 24     // アイドルモードの接続間隔の上限（30ms）
+#endif
+#ifndef BLE_CONN_IDLE_LATENCY
+#define BLE_CONN_IDLE_LATENCY 30          // アイドルモードのスレーブレイテンシ（送るものがなければ最大30回の接続イベントを休む）
+#endif
+#ifndef BLE_CONN_SUPERVISION_TIMEOUT
+#define BLE_CONN_SUPERVISION_TIMEOUT 400  // 監視タイムアウト（4秒、アイドルモードの (1 + レイテンシ) × 間隔 × 2 より長くする）
+#endif
+#ifndef BLE_CONN_IDLE_AFTER_MS
+#define BLE_CONN_IDLE_AFTER_MS 10000      // 入力がこの時間なければアイドルモードへ切り替える（0なら常に低遅延モード）
+#endif
+#ifndef BLE_CONN_UPDATE_WAIT_MS
+#define BLE_CONN_UPDATE_WAIT_MS 5000      // 要求した値に変わるのを待つ時間（過ぎたら不成立として数える）
+#endif
+
+enum ble_conn_mode_t : uint8_t {
+  BLE_CONN_MODE_LOW_LATENCY = 0,  // 接続間隔7.5-15ms・レイテンシ0（入力中）
+  BLE_CONN_MODE_IDLE,             // 間隔を広げ、レイテンシを上げて消費電力を抑える（入力がないとき）
+};
+
+// 接続後にペリフェラル側から接続パラメータの更新を要求し、入力の有無で低遅延とアイドルを切り替える
+// 要求した範囲に収まったかどうかで更新の成否を数え、実際に決まった値と合わせて統計に出す
+// 接続・切断・パラメータ更新はBleLinkEventsから受け、すべてloop()から呼ぶ
+class BleConnPolicy {
+public:
+  void begin(NimBLEServer *server) { this->server = server; }
+
+  // 接続・切断・接続パラメータの更新・MTUの交換
+  void onConnect(uint16_t conn_handle, uint16_t interval, uint16_t latency, uint16_t timeout);
+  void onDisconnect();
+  void onParams(uint16_t interval, uint16_t latency, uint16_t timeout);
+  void onMtu(uint16_t mtu) { this->mtu = mtu; }
+
+  // 入力があったことを知らせる（アイドルモードなら低遅延モードへ戻す）
+  void activity();
+  // モードを固定する（autoIdleがfalseなら入力がなくてもアイドルモードへ移らない）
+  void setMode(ble_conn_mode_t mode, bool autoIdle = true);
+  ble_conn_mode_t mode() const { return this->currentMode; }
+
+  // 要求の送信・アイドルへの切り替え・待ち時間の確認
+  void poll();
+
+  // 現在の接続間隔（1.25ms単位、未接続なら0）
+  uint16_t interval() const { return this->connInterval; }
+  uint16_t latency() const { return this->connLatency; }
+  uint16_t timeout() const { return this->connTimeout; }
+  void printStats() const;
+
+private:
+  void _request(ble_conn_mode_t mode);
+  void _check();
+
+  NimBLEServer *server = NULL;
+  uint16_t connHandle = 0xffff;
+  bool connected = false;
+
+  ble_conn_mode_t currentMode = BLE_CONN_MODE_LOW_LATENCY;
+  bool autoIdle = true;
+  bool needRequest = false;     // 接続直後・モード変更後に要求を送る
+  bool waiting = false;         // 要求した値になるのを待っている
+  uint32_t requestMs = 0;
+  uint32_t lastActivityMs = 0;
+
+  uint16_t connInterval = 0;
+  uint16_t connLatency = 0;
+  uint16_t connTimeout = 0;
+  uint16_t mtu = 0;
+
+  uint32_t requestCount = 0;    // 送った更新要求の数
+  uint32_t acceptedCount = 0;   // 要求した範囲に収まった数
+  uint32_t rejectedCount = 0;   // 待ち時間内に収まらなかった（拒否・別の値で決定）数
+};
+
+#if BLE_CONN_POLICY_ENABLED
+extern BleConnPolicy bleConnPolicy;
+#endif
+
+#endif // BLE_CONN_POLICY_H
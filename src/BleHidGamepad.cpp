@@ -0,0 +1,171 @@
+#include "BleHidGamepad.h"
+#include "BleHidService.h"
+
+#if BLE_GAMEPAD_ENABLED
+BleHidGamepad bleGamepad;
+#endif
+
+// ゲームパッド用のレポートディスクリプタ（ボタン32個・8方向ハット・16ビット6軸）
+static const uint8_t gamepadReportMap[] = {
+  0x05, 0x01,        // Usage Page (Generic Desktop)
+  0x09, 0x05,        // Usage (Gamepad)
+  0xA1, 0x01,        // Collection (Application)
+  0x85, BLE_GAMEPAD_REPORT_ID,  //   Report ID
+  0x05, 0x09,        //   Usage Page (Button)
+  0x19, 0x01,        //   Usage Minimum (1)
+  0x29, 0x20,        //   Usage Maximum (32)
+  0x15, 0x00,        //   Logical Minimum (0)
+  0x25, 0x01,        //   Logical Maximum (1)
+  0x75, 0x01,        //   Report Size (1)
+  0x95, 0x20,        //   Report Count (32)
+  0x81, 0x02,        //   Input (Data, Variable, Absolute)
+  0x05, 0x01,        //   Usage Page (Generic Desktop)
+  0x09, 0x39,        //   Usage (Hat Switch)
+  0x15, 0x00,        //   Logical Minimum (0)
+  0x25, 0x07,        //   Logical Maximum (7)
+  0x35, 0x00,        //   Physical Minimum (0)
+  0x46, 0x3B, 0x01,  //   Physical Maximum (315)
+  0x65, 0x14,        //   Unit (Degrees)
+  0x75, 0x04,        //   Report Size (4)
+  0x95, 0x01,        //   Report Count (1)
+  0x81, 0x42,        //   Input (Data, Variable, Absolute, Null State)
+  0x45, 0x00,        //   Physical Maximum (0)
+  0x65, 0x00,        //   Unit (None)
+  0x75, 0x04,        //   Report Size (4)
+  0x95, 0x01,        //   Report Count (1)
+  0x81, 0x03,        //   Input (Constant)
+  0x09, 0x30,        //   Usage (X)
+  0x09, 0x31,        //   Usage (Y)
+  0x09, 0x32,        //   Usage (Z)
+  0x09, 0x33,        //   Usage (Rx)
+  0x09, 0x34,        //   Usage (Ry)
+  0x09, 0x35,        //   Usage (Rz)
+  0x16, 0x01, 0x80,  //   Logical Minimum (-32767)
+  0x26, 0xFF, 0x7F,  //   Logical Maximum (32767)
+  0x75, 0x10,        //   Report Size (16)
+  0x95, USB_GAMEPAD_AXES,  //   Report Count (6)
+  0x81, 0x02,        //   Input (Data, Variable, Absolute)
+  0xC0,              // End Collection
+};
+
+void BleHidGamepad::begin(NimBLEServer *server) {
+  if (this->input != NULL) {
+    return;
+  }
+  this->input = bleHidCreateInputService(server, gamepadReportMap, sizeof(gamepadReportMap), BLE_GAMEPAD_REPORT_ID);
+  this->pending.hat = this->sent.hat = USB_GAMEPAD_HAT_CENTER;
+}
+
+void BleHidGamepad::onConnect(uint16_t conn_itvl) {
+  uint32_t interval_us = (uint32_t)conn_itvl * 1250;
+  if (interval_us < BLE_GAMEPAD_MIN_INTERVAL_US) {
+    interval_us = BLE_GAMEPAD_MIN_INTERVAL_US;
+  }
+  this->intervalUs.store(interval_us);
+}
+
+void BleHidGamepad::onDisconnect() {
+  this->intervalUs.store(0);
+}
+
+bool BleHidGamepad::_send(int64_t now) {
+  // ボタン(32) + ハット(4)/パディング(4) + 軸16ビット×6（リトルエンディアン）
+  uint8_t report[4 + 1 + USB_GAMEPAD_AXES * 2];
+  const usb_gamepad_state_t &state = this->pending;
+  report[0] = state.buttons & 0xff;
+  report[1] = (state.buttons >> 8) & 0xff;
+  report[2] = (state.buttons >> 16) & 0xff;
+  report[3] = (state.buttons >> 24) & 0xff;
+  report[4] = state.hat & 0x0f;
+  for (int i = 0; i < USB_GAMEPAD_AXES; i++) {
+    report[5 + i * 2] = (uint16_t)state.axes[i] & 0xff;
+    report[6 + i * 2] = ((uint16_t)state.axes[i] >> 8) & 0xff;
+  }
+
+  if (!bleHidNotify(this->input, report, sizeof(report))) {
+    // 未送信のまま残し、待ってからpoll()で送り直す
+    this->retryAtUs = now + BLE_HID_RETRY_US;
+    this->failedCount++;
+    return false;
+  }
+
+  uint32_t latency = (uint32_t)(now - this->dirtySinceUs);
+  this->latencyLastUs = latency;
+  if (latency > this->latencyMaxUs) {
+    this->latencyMaxUs = latency;
+  }
+  this->latencyTotalUs += latency;
+  this->sentCount++;
+
+  this->sent = state;
+  this->dirty = false;
+  this->lastSendUs = now;
+  return true;
+}
+
+void BleHidGamepad::update(const usb_gamepad_state_t &state) {
+  if (this->input == NULL || this->intervalUs.load() == 0) {
+    return;
+  }
+  this->updateCount++;
+
+  // 送った状態と同じなら何もしない（正規化後に変化がないレポートや、戻ってきた軸）
+  bool buttons_changed = (state.buttons != this->sent.buttons || state.hat != this->sent.hat);
+  if (!buttons_changed && memcmp(state.axes, this->sent.axes, sizeof(state.axes)) == 0) {
+    this->pending = state;
+    this->dirty = false;
+    return;
+  }
+
+  if (!this->dirty) {
+    this->dirtySinceUs = state.timestamp_us;
+  }
+  this->pending = state;
+  this->dirty = true;
+
+  // ボタン・ハットの変化は軸の変化ごとすぐに送る（送り直し待ちの間はpoll()に任せる）
+  int64_t now = esp_timer_get_time();
+  if (buttons_changed && now >= this->retryAtUs) {
+    _send(now);
+  }
+}
+
+void BleHidGamepad::poll() {
+  if (this->input == NULL) {
+    return;
+  }
+
+  uint32_t interval_us = this->intervalUs.load();
+  if (interval_us == 0) {
+    // 切断中の状態は捨て、再接続後は中立から始める
+    this->pending = {};
+    this->pending.hat = USB_GAMEPAD_HAT_CENTER;
+    this->sent = this->pending;
+    this->dirty = false;
+    return;
+  }
+
+  if (!this->dirty) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  if (now < this->retryAtUs) {
+    return;
+  }
+  // 送れなかったボタン・ハットの変化は送信間隔を待たずに送り直す
+  bool buttons_pending = (this->pending.buttons != this->sent.buttons || this->pending.hat != this->sent.hat);
+  if (!buttons_pending && now - this->lastSendUs < (int64_t)interval_us) {
+    return;
+  }
+  _send(now);
+}
+
+void BleHidGamepad::printStats() const {
+  Serial.printf("[BLE gamepad] updates=%u sent=%u failed=%u latency last=%uus avg=%uus max=%uus\n",
+                this->updateCount,
+                this->sentCount,
+                this->failedCount,
+                this->latencyLastUs,
+                averageLatencyUs(),
+                this->latencyMaxUs);
+}
@@ -0,0 +1,68 @@
+#ifndef BLE_HID_GAMEPAD_H
+#define BLE_HID_GAMEPAD_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+#include <NimBLEDevice.h>
+#include "EspUsbHost.h"
+
+// BLEゲームパッドの設定（build_flagsで上書き可能）
+#ifndef BLE_GAMEPAD_ENABLED
+#define BLE_GAMEPAD_ENABLED 1             // 0ならゲームパッド用のHIDサービスを追加しない
+#endif
+#ifndef BLE_GAMEPAD_MIN_INTERVAL_US
+#define BLE_GAMEPAD_MIN_INTERVAL_US 7500  // 軸だけが変わったレポートの最短送信間隔（接続間隔がこれより短くてもこの間隔で送る）
+#endif
+#define BLE_GAMEPAD_REPORT_ID 1           // ゲームパッド用HIDサービス内のレポートID
+
+// USBゲームパッドの正規化済み状態をBLEのゲームパッド（ボタン32個・ハット・6軸）として送る
+// 軸の変化は接続間隔ごとに最新の状態へまとめ、ボタン・ハットの変化はその場で送る（短い押下も落とさない）
+// USBの受信（転送完了）から通知までの遅延を計測する
+// update()とpoll()は同じタスク（processReports()を回すloop()）から呼ぶ（接続・切断もBleLinkEventsからloop()で受ける）
+class BleHidGamepad {
+public:
+  // HIDサービスを作成する（BleKeyboard::onStarted()から、広告開始前に呼ぶ）
+  void begin(NimBLEServer *server);
+
+  // 接続・切断・接続間隔の変更（接続間隔は1.25ms単位）
+  void onConnect(uint16_t conn_itvl);
+  void onDisconnect();
+
+  // USBから届いた状態を反映する
+  void update(const usb_gamepad_state_t &state);
+  // 送信間隔が経過していれば保留中の状態を送る
+  void poll();
+
+  // 受信から通知までの遅延（まとめたレポートは最初の変化から数える）
+  uint32_t lastLatencyUs() const { return this->latencyLastUs; }
+  uint32_t maxLatencyUs() const { return this->latencyMaxUs; }
+  uint32_t averageLatencyUs() const { return this->sentCount ? (uint32_t)(this->latencyTotalUs / this->sentCount) : 0; }
+  void printStats() const;
+
+private:
+  bool _send(int64_t now);
+
+  NimBLECharacteristic *input = NULL;
+  std::atomic<uint32_t> intervalUs{0};  // 0なら未接続
+
+  usb_gamepad_state_t pending = {};     // 最新の状態
+  usb_gamepad_state_t sent = {};        // 最後に送った状態
+  bool dirty = false;                   // pendingが未送信
+  int64_t dirtySinceUs = 0;             // 未送信の変化のうち最初のレポートの受信時刻
+  int64_t lastSendUs = 0;               // 最後に送れた時刻
+  int64_t retryAtUs = 0;                // 送れなかったときに送り直す時刻
+
+  uint32_t updateCount = 0;             // USBから届いた状態の数
+  uint32_t sentCount = 0;               // 送ったレポートの数（差がまとめた数）
+  uint32_t failedCount = 0;             // 送れなかった通知の数（最新の状態で送り直す）
+  uint32_t latencyLastUs = 0;
+  uint32_t latencyMaxUs = 0;
+  uint64_t latencyTotalUs = 0;
+};
+
+#if BLE_GAMEPAD_ENABLED
+extern BleHidGamepad bleGamepad;
+#endif
+
+#endif // BLE_HID_GAMEPAD_H
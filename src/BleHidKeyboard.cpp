@@ -0,0 +1,255 @@
+#include "BleHidKeyboard.h"
+#include "EventLog.h"
+
+BleHidKeyboard bleHidKeyboard;
+
+void BleHidKeyboard::attach(NimBLEServer *server) {
+  NimBLEService *hid = server->getServiceByUUID(NimBLEUUID((uint16_t)0x1812));
+  if (hid == NULL) {
+    ESP_LOGW("BleHidKeyboard", "HID service not found, falling back to BleKeyboard::sendReport()");
+    return;
+  }
+
+  // 入力・出力・メディアキーのレポートはどれも0x2A4Dなので、Report Reference（レポートID・種別）で見分ける
+  for (NimBLECharacteristic *characteristic : hid->getCharacteristics(NimBLEUUID((uint16_t)0x2A4D))) {
+    NimBLEDescriptor *reference = characteristic->getDescriptorByUUID(NimBLEUUID((uint16_t)0x2908));
+    if (reference == NULL) {
+      continue;
+    }
+    auto value = reference->getValue();
+    const uint8_t *data = (const uint8_t *)value.data();
+    if (value.length() >= 2 && data[0] == BLE_KEYBOARD_REPORT_ID && data[1] == 0x01) {
+      this->input = characteristic;
+      bleHidTrackNotify(this->input);
+      return;
+    }
+  }
+  ESP_LOGW("BleHidKeyboard", "Keyboard input report not found, falling back to BleKeyboard::sendReport()");
+}
+
+bool BleHidKeyboard::_press(uint8_t usage) {
+  int free_slot = -1;
+  for (int i = 0; i < BLE_KEYBOARD_ROLLOVER; i++) {
+    if (this->report.keys[i] == usage) {
+      return false;
+    }
+    if (this->report.keys[i] == 0 && free_slot < 0) {
+      free_slot = i;
+    }
+  }
+  if (free_slot < 0) {
+    // 7個目以降の同時押しは、先に押したキーが離されて空きができたら入れる
+    this->rolloverCount++;
+    return false;
+  }
+  this->report.keys[free_slot] = usage;
+  return true;
+}
+
+bool BleHidKeyboard::_release(uint8_t usage, const hid_key_bitmap_t &keys) {
+  int slot = -1;
+  for (int i = 0; i < BLE_KEYBOARD_ROLLOVER; i++) {
+    if (this->report.keys[i] == usage) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    return false;
+  }
+  this->report.keys[slot] = 0;
+
+  // 空いた枠に、押されたままレポートに入っていなかったキーを入れる
+  for (int w = 0; w < (HID_KEY_CONTROL_LEFT >> 5); w++) {
+    for (uint32_t bits = keys.word[w]; bits != 0; bits &= bits - 1) {
+      uint8_t candidate = (w << 5) | __builtin_ctz(bits);
+      if (candidate == HID_KEY_NONE) {
+        continue;
+      }
+      bool in_report = false;
+      for (int i = 0; i < BLE_KEYBOARD_ROLLOVER; i++) {
+        in_report |= (this->report.keys[i] == candidate);
+      }
+      if (!in_report) {
+        this->report.keys[slot] = candidate;
+        return true;
+      }
+    }
+  }
+  return true;
+}
+
+// 送信待ちのprev → tail → nextでtailを省いても、ホストから見た押下・解放が失われないか
+// 押下だけが続く（修飾キーは変わらない）か、解放だけが続く場合に限ってまとめる
+static bool keyReportContains(const KeyReport &report, uint8_t usage) {
+  for (int i = 0; i < BLE_KEYBOARD_ROLLOVER; i++) {
+    if (report.keys[i] == usage) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool keyReportSubset(const KeyReport &a, const KeyReport &b) {
+  if ((a.modifiers & ~b.modifiers) != 0) {
+    return false;
+  }
+  for (int i = 0; i < BLE_KEYBOARD_ROLLOVER; i++) {
+    if (a.keys[i] != 0 && !keyReportContains(b, a.keys[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool canCoalesce(const KeyReport &prev, const KeyReport &tail, const KeyReport &next) {
+  bool presses = prev.modifiers == tail.modifiers && tail.modifiers == next.modifiers &&
+                 keyReportSubset(prev, tail) && keyReportSubset(tail, next);
+  bool releases = keyReportSubset(tail, prev) && keyReportSubset(next, tail);
+  return presses || releases;
+}
+
+void BleHidKeyboard::apply(const key_event_t &event, const hid_key_bitmap_t &keys) {
+  bool changed;
+  if (event.usage >= HID_KEY_CONTROL_LEFT) {
+    changed = (this->report.modifiers != event.modifier);
+    this->report.modifiers = event.modifier;
+  } else if (event.pressed) {
+    changed = _press(event.usage);
+  } else {
+    changed = _release(event.usage, keys);
+  }
+
+  if (changed) {
+    _enqueue(event);
+    poll();
+  }
+}
+
+void BleHidKeyboard::_enqueue(const key_event_t &event) {
+  int64_t now = esp_timer_get_time();
+  this->enqueuedCount++;
+  if (!this->connected) {
+    // 未接続の間も送信待ちに積むが、接続までにBLE_KEYBOARD_MAX_AGE_USを過ぎた途中の状態は送らない
+    EVENT_LOG(EVT_BLE_NOT_CONNECTED, event.usage);
+  }
+
+  if (this->count > 0 && canCoalesce(_before(this->count - 1), _at(this->count - 1).report, this->report)) {
+    this->coalescedCount++;
+    queued_report_t &tail = _at(this->count - 1);
+    tail.report = this->report;
+    tail.usage = event.usage;
+    tail.pressed = event.pressed;
+    tail.queuedUs = now;
+    tail.offline = !this->connected;
+    return;
+  }
+
+  if (this->count >= BLE_KEYBOARD_QUEUE_SIZE) {
+    _makeRoom();
+  }
+  queued_report_t &entry = _at(this->count);
+  entry.report = this->report;
+  entry.usage = event.usage;
+  entry.pressed = event.pressed;
+  entry.queuedUs = now;
+  entry.offline = !this->connected;
+  this->count++;
+}
+
+// 送信待ちが満杯のとき、ホストから見た押下・解放がなるべく失われない順に1つ以上空ける
+void BleHidKeyboard::_makeRoom() {
+  // 前後とまとめられるレポート（古い方から）
+  for (uint32_t i = 0; i + 1 < this->count; i++) {
+    if (canCoalesce(_before(i), _at(i).report, _at(i + 1).report)) {
+      _remove(i, 1);
+      this->coalescedCount++;
+      return;
+    }
+  }
+  // 押下と解放の組（打鍵1回分を捨てても、その前後のキー状態は変わらない）
+  for (uint32_t i = 0; i + 1 < this->count; i++) {
+    if (memcmp(&_before(i), &_at(i + 1).report, sizeof(KeyReport)) == 0) {
+      _remove(i, 2);
+      this->droppedCount += 2;
+      return;
+    }
+  }
+  // どちらもなければ最も古い途中の状態を捨てる（最後のレポートは残るので最終的なキー状態は届く）
+  _remove(0, 1);
+  this->droppedCount++;
+}
+
+void BleHidKeyboard::_remove(uint32_t pos, uint32_t n) {
+  for (uint32_t i = pos; i + n < this->count; i++) {
+    _at(i) = _at(i + n);
+  }
+  this->count -= n;
+}
+
+void BleHidKeyboard::setConnected(bool connected) {
+  // 接続し直したホストはキーをすべて離した状態から始まる
+  this->connected = connected;
+  this->lastSent = {};
+  this->retryAtUs = 0;
+  poll();
+}
+
+void BleHidKeyboard::poll() {
+  if (!this->connected || this->keyboard == NULL || this->count == 0) {
+    return;
+  }
+
+  // 未接続の間に積んで古くなった途中の状態は捨てる（最後のレポートは今のキー状態なので必ず送る）
+  // 接続中に積んだものは、輻輳で待たされていても捨てずに順に送る
+  int64_t now = esp_timer_get_time();
+  while (this->count > 1 && _at(0).offline && now - _at(0).queuedUs > BLE_KEYBOARD_MAX_AGE_US) {
+    this->head = (this->head + 1) % BLE_KEYBOARD_QUEUE_SIZE;
+    this->count--;
+    this->expiredCount++;
+  }
+
+  if (now < this->retryAtUs) {
+    return;
+  }
+  while (this->count > 0) {
+    if (!_send(_at(0))) {
+      // 送れなかったレポートは先頭に残したまま止め、待ってから同じものを送り直す
+      this->failedCount++;
+      this->retryAtUs = now + BLE_HID_RETRY_US;
+      return;
+    }
+    this->head = (this->head + 1) % BLE_KEYBOARD_QUEUE_SIZE;
+    this->count--;
+  }
+}
+
+bool BleHidKeyboard::_send(const queued_report_t &entry) {
+  KeyReport report = entry.report;
+  if (this->input != NULL) {
+    if (!bleHidNotify(this->input, (const uint8_t *)&report, sizeof(report))) {
+      return false;
+    }
+  } else {
+    // BleKeyboard::sendReport()は送信結果を返さない
+    this->keyboard->sendReport(&report);
+  }
+  EVENT_LOG_DATA(EVT_BLE_SEND, entry.usage, entry.pressed, entry.report.modifiers,
+                 (const uint8_t *)&entry.report, sizeof(entry.report));
+  this->lastSent = report;
+  this->sentCount++;
+  return true;
+}
+
+void BleHidKeyboard::printStats() const {
+  Serial.printf("[BLE keyboard] enqueued=%u coalesced=%u sent=%u dropped=%u expired=%u failed=%u rollover=%u queued=%u%s\n",
+                this->enqueuedCount,
+                this->coalescedCount,
+                this->sentCount,
+                this->droppedCount,
+                this->expiredCount,
+                this->failedCount,
+                this->rolloverCount,
+                this->count,
+                this->input != NULL ? "" : " (via BleKeyboard::sendReport)");
+}
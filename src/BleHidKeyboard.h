@@ -0,0 +1,89 @@
+#ifndef BLE_HID_KEYBOARD_H
+#define BLE_HID_KEYBOARD_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <BleKeyboard.h>
+#include "KeyPipeline.h"
+#include "BleHidService.h"
+
+// BLEキーボード出力の設定（build_flagsで上書き可能）
+#ifndef BLE_KEYBOARD_QUEUE_SIZE
+#define BLE_KEYBOARD_QUEUE_SIZE 32        // 送信待ちにできるレポート数（あふれたらまとめられるものか押下・解放の組から捨てる）
+#endif
+#ifndef BLE_KEYBOARD_MAX_AGE_US
+#define BLE_KEYBOARD_MAX_AGE_US 500000    // 未接続の間にこれより前に積んだ途中の状態は送らずに捨てる（再接続後に打たない）
+#endif
+#define BLE_KEYBOARD_ROLLOVER 6           // 1レポートに入る修飾キー以外のキー数（ブートキーボード形式）
+#define BLE_KEYBOARD_REPORT_ID 1          // BleKeyboardのHIDサービス内のキーボード入力レポートID
+
+// キーパイプラインのキー状態をBLEキーボードの入力レポート（modifier + 6キー）へそのまま写す
+// 押下・解放・修飾キーの変化ごとにレポートを1つ作るので、押しっぱなしのキーはホスト側でリピートされ、
+// 修飾キーとの同時押しも押した順のまま届く
+// 作ったレポートは固定長の送信待ちに積み、BleKeyboardのHIDサービスの入力レポートのキャラクタリスティックへ
+// 先頭から順に直接書き込む（BleKeyboard::sendReport()は1レポートごとに数msの待ちを入れるため使わない）
+// 通知がmbuf・コントローラのバッファ不足で送れなければ、先頭のレポートを残したまま止めて同じものを送り直す
+// 輻輳・未接続でもapply()は待たない。送信待ちでは意味が変わらない範囲で続きのレポートをまとめ、
+// あふれたときはまとめられるレポートか、押下と解放の組（打鍵1回分）を捨てる
+// 最後のレポートは捨てないので、途中の状態が失われても最終的なキー状態は必ず届く
+// apply()とpoll()は同じタスク（processReports()を回すloop()）から呼ぶ
+class BleHidKeyboard {
+public:
+  void begin(BleKeyboard *keyboard) { this->keyboard = keyboard; }
+  // キーボード入力レポートのキャラクタリスティックを探す（BleKeyboard::onStarted()から、広告開始前に呼ぶ）
+  // 見つからなければBleKeyboard::sendReport()で送る
+  void attach(NimBLEServer *server);
+
+  // キー状態の変化を1つ反映し、レポートが変わっていれば送信待ちに積む（keysは変化を反映した後のキー状態）
+  void apply(const key_event_t &event, const hid_key_bitmap_t &keys);
+  // 送信待ちのレポートを送れるだけ送る（未接続の間に積んで古くなった途中の状態は捨てる）
+  void poll();
+  // 接続・切断（BleLinkEventsから、loop()で呼ぶ）。接続したら送信待ちをすぐ送り始める
+  void setConnected(bool connected);
+
+  const KeyReport &currentReport() const { return this->report; }
+  uint32_t queued() const { return this->count; }
+  void printStats() const;
+
+private:
+  struct queued_report_t {
+    KeyReport report;
+    uint8_t usage;    // このレポートを作った変化（ログ用）
+    bool pressed;
+    int64_t queuedUs; // 送信待ちに積んだ時刻
+    bool offline;     // 未接続の間に積んだ（古くなったら捨ててよい）
+  };
+
+  bool _press(uint8_t usage);
+  bool _release(uint8_t usage, const hid_key_bitmap_t &keys);
+  void _enqueue(const key_event_t &event);
+  void _makeRoom();
+  void _remove(uint32_t pos, uint32_t n);
+  queued_report_t &_at(uint32_t pos) { return this->queue[(this->head + pos) % BLE_KEYBOARD_QUEUE_SIZE]; }
+  const KeyReport &_before(uint32_t pos) { return (pos > 0) ? _at(pos - 1).report : this->lastSent; }
+  bool _send(const queued_report_t &entry);
+
+  BleKeyboard *keyboard = NULL;
+  NimBLECharacteristic *input = NULL;  // キーボード入力レポート（レポートID 1）
+  KeyReport report = {};        // ホストへ写しているキー状態
+
+  queued_report_t queue[BLE_KEYBOARD_QUEUE_SIZE];
+  uint32_t head = 0;            // 次に送るレポートの位置
+  uint32_t count = 0;
+  KeyReport lastSent = {};      // 最後に送ったレポート（送信待ちの先頭をまとめるときの基準）
+
+  int64_t retryAtUs = 0;        // 送れなかった先頭のレポートを送り直す時刻
+  bool connected = false;
+
+  uint32_t enqueuedCount = 0;   // 送信待ちに積んだレポートの数
+  uint32_t coalescedCount = 0;  // 前のレポートとまとめた数（押下・解放は失われない）
+  uint32_t sentCount = 0;       // 送ったレポートの数
+  uint32_t droppedCount = 0;    // あふれて捨てたレポートの数（まとめられるもの、または押下・解放の組）
+  uint32_t expiredCount = 0;    // 未接続の間に積んで古くなり、捨てたレポートの数
+  uint32_t failedCount = 0;     // 送れなかった通知の数（同じレポートを送り直す）
+  uint32_t rolloverCount = 0;   // 空きがなくレポートに入らなかった押下の数
+};
+
+extern BleHidKeyboard bleHidKeyboard;
+
+#endif // BLE_HID_KEYBOARD_H
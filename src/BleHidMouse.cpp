@@ -0,0 +1,206 @@
+#include "BleHidMouse.h"
+#include "BleHidService.h"
+
+#if BLE_MOUSE_ENABLED
+BleHidMouse bleMouse;
+#endif
+
+// マウス用のレポートディスクリプタ（ボタン5個・X・Y・ホイール・水平スクロール）
+// X/Yは16ビットにして、1000Hzのマウスを7.5msの接続間隔へまとめても1レポートで送り切れるようにする
+static const uint8_t mouseReportMap[] = {
+  0x05, 0x01,        // Usage Page (Generic Desktop)
+  0x09, 0x02,        // Usage (Mouse)
+  0xA1, 0x01,        // Collection (Application)
+  0x85, BLE_MOUSE_REPORT_ID,  //   Report ID
+  0x09, 0x01,        //   Usage (Pointer)
+  0xA1, 0x00,        //   Collection (Physical)
+  0x05, 0x09,        //     Usage Page (Button)
+  0x19, 0x01,        //     Usage Minimum (1)
+  0x29, 0x05,        //     Usage Maximum (5)
+  0x15, 0x00,        //     Logical Minimum (0)
+  0x25, 0x01,        //     Logical Maximum (1)
+  0x95, 0x05,        //     Report Count (5)
+  0x75, 0x01,        //     Report Size (1)
+  0x81, 0x02,        //     Input (Data, Variable, Absolute)
+  0x95, 0x01,        //     Report Count (1)
+  0x75, 0x03,        //     Report Size (3)
+  0x81, 0x03,        //     Input (Constant)
+  0x05, 0x01,        //     Usage Page (Generic Desktop)
+  0x09, 0x30,        //     Usage (X)
+  0x09, 0x31,        //     Usage (Y)
+  0x16, 0x01, 0x80,  //     Logical Minimum (-32767)
+  0x26, 0xFF, 0x7F,  //     Logical Maximum (32767)
+  0x75, 0x10,        //     Report Size (16)
+  0x95, 0x02,        //     Report Count (2)
+  0x81, 0x06,        //     Input (Data, Variable, Relative)
+  0x09, 0x38,        //     Usage (Wheel)
+  0x15, 0x81,        //     Logical Minimum (-127)
+  0x25, 0x7F,        //     Logical Maximum (127)
+  0x75, 0x08,        //     Report Size (8)
+  0x95, 0x01,        //     Report Count (1)
+  0x81, 0x06,        //     Input (Data, Variable, Relative)
+  0x05, 0x0C,        //     Usage Page (Consumer)
+  0x0A, 0x38, 0x02,  //     Usage (AC Pan)
+  0x15, 0x81,        //     Logical Minimum (-127)
+  0x25, 0x7F,        //     Logical Maximum (127)
+  0x75, 0x08,        //     Report Size (8)
+  0x95, 0x01,        //     Report Count (1)
+  0x81, 0x06,        //     Input (Data, Variable, Relative)
+  0xC0,              //   End Collection
+  0xC0,              // End Collection
+};
+
+void BleHidMouse::begin(NimBLEServer *server) {
+  if (this->input != NULL) {
+    return;
+  }
+
+  this->input = bleHidCreateInputService(server, mouseReportMap, sizeof(mouseReportMap), BLE_MOUSE_REPORT_ID);
+}
+
+void BleHidMouse::onConnect(uint16_t conn_itvl) {
+  uint32_t interval_us = (uint32_t)conn_itvl * 1250;
+  if (interval_us < BLE_MOUSE_MIN_INTERVAL_US) {
+    interval_us = BLE_MOUSE_MIN_INTERVAL_US;
+  }
+  this->intervalUs.store(interval_us);
+}
+
+void BleHidMouse::onDisconnect() {
+  this->intervalUs.store(0);
+}
+
+int32_t BleHidMouse::_take(int32_t &accumulated, int32_t limit) {
+  int32_t value = accumulated;
+  if (value > limit) {
+    value = limit;
+  } else if (value < -limit) {
+    value = -limit;
+  }
+  accumulated -= value;
+  return value;
+}
+
+bool BleHidMouse::_send(uint8_t buttons) {
+  int32_t x = _take(this->x, 32767);
+  int32_t y = _take(this->y, 32767);
+  int32_t wheel = _take(this->wheel, 127);
+  int32_t pan = _take(this->pan, 127);
+  uint8_t report[7];
+  report[0] = buttons;
+  report[1] = x & 0xff;
+  report[2] = (x >> 8) & 0xff;
+  report[3] = y & 0xff;
+  report[4] = (y >> 8) & 0xff;
+  report[5] = (uint8_t)wheel;
+  report[6] = (uint8_t)pan;
+
+  int64_t now = esp_timer_get_time();
+  if (!bleHidNotify(this->input, report, sizeof(report))) {
+    // 送れなかった移動量は戻し、ボタン状態とあわせて次のpoll()で送り直す
+    this->x += x;
+    this->y += y;
+    this->wheel += wheel;
+    this->pan += pan;
+    this->retryAtUs = now + BLE_HID_RETRY_US;
+    this->failedCount++;
+    return false;
+  }
+  this->sentButtons = buttons;
+  this->lastSendUs = now;
+  this->sentCount++;
+  return true;
+}
+
+void BleHidMouse::report(const usb_mouse_report_t &report) {
+  if (this->input == NULL || this->intervalUs.load() == 0) {
+    return;
+  }
+  this->inCount++;
+
+  // 送れていない変化の後ろに届いた分は、順番を保つためそちらへ溜める
+  // （その間にさらにボタンが変わったら最新の状態にまとめる。最終的なボタン状態は必ず届く）
+  if (this->edge.pending) {
+    this->edge.buttons = report.buttons;
+    this->edge.x += report.x;
+    this->edge.y += report.y;
+    this->edge.wheel += report.wheel;
+    this->edge.pan += report.pan;
+    return;
+  }
+
+  // ボタンが変わる前の移動（とまだ送れていない前の変化）は変化前のボタン状態で送り切ってから、
+  // 変化をすぐに送る（ドラッグの始点・終点がずれない）
+  if (report.buttons != this->buttons) {
+    int64_t now = esp_timer_get_time();
+    if (this->buttons != this->sentButtons || _moved()) {
+      if (now < this->retryAtUs || !_send(this->buttons)) {
+        // 変化前の状態を送れないので、変化は後ろに残してpoll()で順に送り直す
+        this->edge = { true, report.buttons, report.x, report.y, report.wheel, report.pan };
+        return;
+      }
+    }
+    this->buttons = report.buttons;
+    this->x += report.x;
+    this->y += report.y;
+    this->wheel += report.wheel;
+    this->pan += report.pan;
+    if (now >= this->retryAtUs) {
+      _send(this->buttons);
+    }
+    return;
+  }
+
+  // 移動量は積算だけして、送信はpoll()で接続間隔ごとにまとめる
+  this->x += report.x;
+  this->y += report.y;
+  this->wheel += report.wheel;
+  this->pan += report.pan;
+}
+
+void BleHidMouse::poll() {
+  if (this->input == NULL) {
+    return;
+  }
+
+  uint32_t interval_us = this->intervalUs.load();
+  if (interval_us == 0) {
+    // 切断中の移動は捨て、再接続後はボタンを離した状態から始める
+    this->x = this->y = this->wheel = this->pan = 0;
+    this->buttons = this->sentButtons = 0;
+    this->edge = {};
+    return;
+  }
+
+  // 送れなかったボタンの変化は送信間隔を待たずに送り直す
+  bool buttonsPending = (this->buttons != this->sentButtons);
+  if (!buttonsPending && !_moved() && !this->edge.pending) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  if (now < this->retryAtUs) {
+    return;
+  }
+  if (buttonsPending || _moved()) {
+    if (!buttonsPending && !this->edge.pending && now - this->lastSendUs < (int64_t)interval_us) {
+      return;
+    }
+    if (!_send(this->buttons)) {
+      return;
+    }
+  }
+  // 変化前の状態を送れたので、残しておいた変化を続けて送る
+  if (this->edge.pending) {
+    _takeEdge();
+    _send(this->buttons);
+  }
+}
+
+void BleHidMouse::_takeEdge() {
+  this->buttons = this->edge.buttons;
+  this->x += this->edge.x;
+  this->y += this->edge.y;
+  this->wheel += this->edge.wheel;
+  this->pan += this->edge.pan;
+  this->edge = {};
+}
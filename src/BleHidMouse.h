@@ -0,0 +1,78 @@
+#ifndef BLE_HID_MOUSE_H
+#define BLE_HID_MOUSE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+#include <NimBLEDevice.h>
+#include "EspUsbHost.h"
+
+// BLEマウスの設定（build_flagsで上書き可能）
+#ifndef BLE_MOUSE_ENABLED
+#define BLE_MOUSE_ENABLED 1               // 0ならマウス用のHIDサービスを追加しない
+#endif
+#ifndef BLE_MOUSE_MIN_INTERVAL_US
+#define BLE_MOUSE_MIN_INTERVAL_US 7500    // 移動レポートの最短送信間隔（接続間隔がこれより短くてもこの間隔で送る）
+#endif
+#define BLE_MOUSE_REPORT_ID 1             // マウス用HIDサービス内のレポートID
+
+// USBマウスの移動量を積算し、BLEの接続間隔ごとに1レポートへまとめて送るマウス出力（マウス専用のHIDサービスを追加する）
+// report()とpoll()は同じタスク（processReports()を回すloop()）から呼ぶ（接続・切断もBleLinkEventsからloop()で受ける）
+class BleHidMouse {
+public:
+  // HIDサービスを作成する（BleKeyboard::onStarted()から、広告開始前に呼ぶ）
+  void begin(NimBLEServer *server);
+
+  // 接続・切断・接続間隔の変更（接続間隔は1.25ms単位）
+  void onConnect(uint16_t conn_itvl);
+  void onDisconnect();
+
+  // USBのマウスレポートを積算する（ボタンの変化はその場で送る）
+  void report(const usb_mouse_report_t &report);
+  // 送信間隔が経過していれば溜まった移動量を1レポートで送る（送れなかったボタンの変化もここで送り直す）
+  void poll();
+
+  uint32_t reportsIn() const { return this->inCount; }
+  uint32_t reportsSent() const { return this->sentCount; }
+  uint32_t reportsFailed() const { return this->failedCount; }
+
+private:
+  bool _send(uint8_t buttons);
+  void _takeEdge();
+  bool _moved() const { return this->x != 0 || this->y != 0 || this->wheel != 0 || this->pan != 0; }
+  static int32_t _take(int32_t &accumulated, int32_t limit);
+
+  NimBLECharacteristic *input = NULL;
+  std::atomic<uint32_t> intervalUs{0};  // 0なら未接続
+
+  // 未送信の移動量（レポートの範囲に収まらない分は次のレポートへ繰り越す）
+  int32_t x = 0;
+  int32_t y = 0;
+  int32_t wheel = 0;
+  int32_t pan = 0;
+  uint8_t buttons = 0;      // USBマウスの現在のボタン状態
+  uint8_t sentButtons = 0;  // ホストへ送れたボタン状態（ボタンの変化は常にその場で送る）
+  int64_t lastSendUs = 0;   // 最後に送れた時刻
+  int64_t retryAtUs = 0;    // 送れなかったときに送り直す時刻
+
+  // 変化前の状態を送れないうちに届いたボタンの変化と、その後の移動量（変化前の状態を送れたら続けて送る）
+  struct pending_edge_t {
+    bool pending;
+    uint8_t buttons;
+    int32_t x;
+    int32_t y;
+    int32_t wheel;
+    int32_t pan;
+  };
+  pending_edge_t edge = {};
+
+  uint32_t inCount = 0;
+  uint32_t sentCount = 0;
+  uint32_t failedCount = 0; // 送れなかった通知の数（同じ内容で送り直す）
+};
+
+#if BLE_MOUSE_ENABLED
+extern BleHidMouse bleMouse;
+#endif
+
+#endif // BLE_HID_MOUSE_H
@@ -0,0 +1,65 @@
+#include "BleHidService.h"
+
+// notify()の中で呼ばれる送信結果のコールバックが書き込む（呼び出しはすべてloop()から）
+enum {
+  BLE_HID_NOTIFY_PENDING,
+  BLE_HID_NOTIFY_SENT,
+  BLE_HID_NOTIFY_FAILED,
+};
+static uint8_t notifyResult = BLE_HID_NOTIFY_PENDING;
+
+class NotifyResultCallbacks : public NimBLECharacteristicCallbacks {
+  void onStatus(NimBLECharacteristic *characteristic, Status status, int code) override {
+    switch (status) {
+      case SUCCESS_NOTIFY:
+        notifyResult = (code == 0) ? BLE_HID_NOTIFY_SENT : BLE_HID_NOTIFY_FAILED;
+        break;
+      case ERROR_GATT:
+        notifyResult = BLE_HID_NOTIFY_FAILED;
+        break;
+      case ERROR_NOTIFY_DISABLED:
+      case ERROR_NO_CLIENT:
+        // ホストが購読していないので、送り直しても届かない（送れたものとして扱う）
+        notifyResult = BLE_HID_NOTIFY_SENT;
+        break;
+      default:
+        break;
+    }
+  }
+};
+static NotifyResultCallbacks notifyCallbacks;
+
+void bleHidTrackNotify(NimBLECharacteristic *input) {
+  input->setCallbacks(&notifyCallbacks);
+}
+
+bool bleHidNotify(NimBLECharacteristic *input, const uint8_t *data, size_t length) {
+  notifyResult = BLE_HID_NOTIFY_PENDING;
+  input->setValue(data, length);
+  input->notify();
+  // 結果が返らなかった場合は、ホストスタックが受け取ったものとして扱う
+  return notifyResult != BLE_HID_NOTIFY_FAILED;
+}
+
+NimBLECharacteristic *bleHidCreateInputService(NimBLEServer *server, const uint8_t *report_map, size_t report_map_length, uint8_t report_id) {
+  // HOGPのHIDサービス（キーボード側のサービスとは別インスタンス）
+  NimBLEService *service = server->createService(NimBLEUUID((uint16_t)0x1812));
+
+  // HID Information（bcdHID 1.11、国コードなし、RemoteWake）
+  static const uint8_t hidInfo[] = { 0x11, 0x01, 0x00, 0x01 };
+  service->createCharacteristic((uint16_t)0x2a4a, NIMBLE_PROPERTY::READ)->setValue(hidInfo, sizeof(hidInfo));
+  service->createCharacteristic((uint16_t)0x2a4b, NIMBLE_PROPERTY::READ)->setValue(report_map, report_map_length);
+  service->createCharacteristic((uint16_t)0x2a4c, NIMBLE_PROPERTY::WRITE_NR);
+  static const uint8_t reportMode = 0x01;
+  service->createCharacteristic((uint16_t)0x2a4e, NIMBLE_PROPERTY::WRITE_NR | NIMBLE_PROPERTY::READ)->setValue(&reportMode, 1);
+
+  // Input Report（Report Referenceでレポートマップ内のIDと結びつける）
+  NimBLECharacteristic *input = service->createCharacteristic((uint16_t)0x2a4d, NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY | NIMBLE_PROPERTY::READ_ENC);
+  uint8_t reportReference[] = { report_id, 0x01 };  // ID, Input
+  input->createDescriptor((uint16_t)0x2908, NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::READ_ENC, sizeof(reportReference))
+      ->setValue(reportReference, sizeof(reportReference));
+  bleHidTrackNotify(input);
+
+  service->start();
+  return input;
+}
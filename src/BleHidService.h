@@ -0,0 +1,23 @@
+#ifndef BLE_HID_SERVICE_H
+#define BLE_HID_SERVICE_H
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+
+#ifndef BLE_HID_RETRY_US
+#define BLE_HID_RETRY_US 1000             // 通知を送れなかったときに送り直すまでの待ち時間
+#endif
+
+// Input Reportを1つだけ持つHOGPのHIDサービスを作成し、そのInput Reportの特性を返す
+// BleKeyboardのレポートマップは固定なので、マウス・ゲームパッドは同じサーバーに別のHIDサービスとして追加する
+// （BleKeyboard::onStarted()から、広告開始前に呼ぶ）
+NimBLECharacteristic *bleHidCreateInputService(NimBLEServer *server, const uint8_t *report_map, size_t report_map_length, uint8_t report_id);
+
+// 他で作ったInput Report（BleKeyboardのキーボード入力レポート等）の送信結果もbleHidNotify()で受け取れるようにする
+void bleHidTrackNotify(NimBLECharacteristic *input);
+// Input Reportを書き込んで通知し、送れたかを返す
+// NimBLEは送信結果（BLE_GAP_EVENT_NOTIFY_TX）をnotify()の中で返すので、戻った時点で結果が決まっている
+// mbuf・コントローラのバッファが尽きていればfalse（何も送れていないので、呼び出し側が同じ内容で送り直す）
+bool bleHidNotify(NimBLECharacteristic *input, const uint8_t *data, size_t length);
+
+#endif // BLE_HID_SERVICE_H
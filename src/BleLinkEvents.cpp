@@ -0,0 +1,72 @@
+#include "BleLinkEvents.h"
+
+BleLinkEvents bleLinkEvents;
+
+static ble_gap_event_listener gapListener;
+
+// NimBLEのホストタスクで、サーバーのGAPイベント処理とは別に呼ばれる
+static int onGapEvent(struct ble_gap_event *event, void *arg) {
+  if (event->type == BLE_GAP_EVENT_CONN_UPDATE && event->conn_update.status == 0) {
+    ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(event->conn_update.conn_handle, &desc) == 0) {
+      ((BleLinkEvents *)arg)->pushParams(&desc);
+    }
+  }
+  return 0;
+}
+
+void BleLinkEvents::begin() {
+  if (this->listening) {
+    return;
+  }
+  int rc = ble_gap_event_listener_register(&gapListener, onGapEvent, this);
+  if (rc != 0) {
+    ESP_LOGW("BleLinkEvents", "ble_gap_event_listener_register() rc=%d, connection parameter updates will not be reported", rc);
+    return;
+  }
+  this->listening = true;
+}
+
+void BleLinkEvents::_push(uint8_t type, uint16_t conn_handle, const ble_gap_conn_desc *desc, uint16_t mtu) {
+  ble_link_event_t *event = this->ring.acquire();
+  if (event == nullptr) {
+    return;
+  }
+  *event = {};
+  event->type = type;
+  event->connHandle = conn_handle;
+  if (desc != NULL) {
+    event->interval = desc->conn_itvl;
+    event->latency = desc->conn_latency;
+    event->timeout = desc->supervision_timeout;
+  }
+  event->mtu = mtu;
+  event->timestamp_us = esp_timer_get_time();
+  this->ring.commit();
+}
+
+void BleLinkEvents::pushConnect(const ble_gap_conn_desc *desc) {
+  _push(BLE_LINK_CONNECTED, desc->conn_handle, desc, 0);
+}
+
+void BleLinkEvents::pushDisconnect() {
+  _push(BLE_LINK_DISCONNECTED, 0xffff, NULL, 0);
+}
+
+void BleLinkEvents::pushMtu(uint16_t conn_handle, uint16_t mtu) {
+  _push(BLE_LINK_MTU, conn_handle, NULL, mtu);
+}
+
+void BleLinkEvents::pushParams(const ble_gap_conn_desc *desc) {
+  _push(BLE_LINK_PARAMS, desc->conn_handle, desc, 0);
+}
+
+bool BleLinkEvents::pop(ble_link_event_t &event) {
+  ble_link_event_t *slot = this->ring.peek();
+  if (slot == nullptr) {
+    return false;
+  }
+  event = *slot;
+  this->ring.release();
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef BLE_LINK_EVENTS_H
+#define BLE_LINK_EVENTS_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <NimBLEDevice.h>
+#include "SpscRing.h"
+
+// BLE接続イベントの設定（build_flagsで上書き可能）
+#ifndef BLE_LINK_EVENT_RING_SIZE
+#define BLE_LINK_EVENT_RING_SIZE 16       // loop()が取り出すまで溜めておけるイベント数（2のべき乗）
+#endif
+
+enum ble_link_event_type_t : uint8_t {
+  BLE_LINK_CONNECTED = 0,   // 接続（間隔・レイテンシ・タイムアウトは接続時の値）
+  BLE_LINK_DISCONNECTED,
+  BLE_LINK_MTU,             // ATT MTUの交換
+  BLE_LINK_PARAMS,          // 接続パラメータの更新（セントラル・ペリフェラルどちらからの更新も）
+};
+
+struct ble_link_event_t {
+  uint8_t type;             // ble_link_event_type_t
+  uint16_t connHandle;
+  uint16_t interval;        // 1.25ms単位
+  uint16_t latency;
+  uint16_t timeout;         // 10ms単位
+  uint16_t mtu;
+  int64_t timestamp_us;
+};
+
+// BLEスタックからの接続・切断・MTU・接続パラメータ更新をイベントとしてloop()へ渡す
+// 書き込みはNimBLEのホストタスク（サーバーのコールバックとGAPのイベントリスナー）だけ、
+// 取り出しはloop()だけなので、キー処理と同じ順序で反映され、状態をポーリングする必要がない
+class BleLinkEvents {
+public:
+  // 接続パラメータ更新のGAPイベントリスナーを登録する（NimBLEServerCallbacksには更新の通知がないため）
+  void begin();
+
+  // NimBLEのホストタスクから呼ぶ
+  void pushConnect(const ble_gap_conn_desc *desc);
+  void pushDisconnect();
+  void pushMtu(uint16_t conn_handle, uint16_t mtu);
+  void pushParams(const ble_gap_conn_desc *desc);
+
+  // loop()から呼ぶ（なければfalse）
+  bool pop(ble_link_event_t &event);
+  uint32_t dropped() const { return this->ring.overflowCount(); }
+
+private:
+  void _push(uint8_t type, uint16_t conn_handle, const ble_gap_conn_desc *desc, uint16_t mtu);
+
+  SpscRing<ble_link_event_t, BLE_LINK_EVENT_RING_SIZE> ring;
+  bool listening = false;
+};
+
+extern BleLinkEvents bleLinkEvents;
+
+#endif // BLE_LINK_EVENTS_H
@@ -174,7 +174,7 @@ void DisplayController::showRawKeyCode(uint8_t keycode, const char* description)
     display.display();
 }
 
-void DisplayController::showDeviceInfo(const String& manufacturer, const String& productName, 
+void DisplayController::showDeviceInfo(const char* manufacturer, const char* productName,
                                      uint16_t idVendor, uint16_t idProduct) {
     deviceName = productName;
     vendorId = idVendor;
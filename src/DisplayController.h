@@ -33,8 +33,8 @@ public:
     // 生のキーコードを表示するための特別なメソッド
     void showRawKeyCode(uint8_t keycode, const char* description);
     
-    // デバイス情報の更新
-    void showDeviceInfo(const String& manufacturer, const String& productName, 
+    // デバイス情報の更新（文字列はコピーせず参照を保持するので、EspUsbHostのフィールドなど寿命の長いバッファを渡す）
+    void showDeviceInfo(const char* manufacturer, const char* productName,
                       uint16_t idVendor, uint16_t idProduct);
     
     // 接続状態の設定
@@ -62,7 +62,7 @@ private:
     bool bleConnected = false;
     
     // デバイス情報
-    String deviceName = "None";
+    const char* deviceName = "None";
     uint16_t vendorId = 0;
     uint16_t productId = 0;
 };
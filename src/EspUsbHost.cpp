@@ -1,37 +1,26 @@
 #include "EspUsbHost.h"
+#include "EventLog.h"
+#include "UsbCapture.h"
 
-void EspUsbHost::_printPcapText(const char *title, uint16_t function, uint8_t direction, uint8_t endpoint, uint8_t type, uint8_t size, uint8_t stage, const uint8_t *data) {
-#if (ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO)
-  uint8_t urbsize = 0x1c;
-  if (stage == 0xff) {
-    urbsize = 0x1b;
-  }
+void EspUsbHost::begin(void) {
+  this->descriptorCache.begin();
+
+  const esp_timer_create_args_t retry_timer_args = {
+    .callback = _retryTimerCallback,
+    .arg = this,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "usbRetry",
+    .skip_unhandled_events = true,
+  };
+  esp_timer_create(&retry_timer_args, &this->retryTimer);
 
-  String data_str = "";
-  for (int i = 0; i < size; i++) {
-    if (data[i] < 16) {
-      data_str += "0";
-    }
-    data_str += String(data[i], HEX) + " ";
+  for (int i = 0; i < USB_HOST_MAX_DEVICES; i++) {
+    this->devices[i].usbHost = this;
+    this->devices[i].index = i;
+    this->devices[i].inUse = false;
+    this->devices[i].isReady = false;
   }
 
-  printf("\n");
-  printf("[PCAP TEXT]%s\n", title);
-  printf("0000  %02x 00 00 00 00 00 00 00 00 00 00 00 00 00 %02x %02x\n", urbsize, (function & 0xff), ((function >> 8) & 0xff));
-  printf("0010  %02x 01 00 01 00 %02x %02x %02x 00 00 00", direction, endpoint, type, size);
-  if (stage != 0xff) {
-    printf(" %02x\n", stage);
-  } else {
-    printf("\n");
-  }
-  printf("00%02x  %s\n", urbsize, data_str.c_str());
-  printf("\n");
-#endif
-}
-
-void EspUsbHost::begin(void) {
-  usbTransferSize = 0;
-
   const usb_host_config_t config = {
     .skip_phy_setup = false,
     .intr_flags = ESP_INTR_FLAG_LEVEL1,
@@ -63,21 +52,37 @@ void EspUsbHost::_clientEventCallback(const usb_host_client_event_msg_t *eventMs
   EspUsbHost *usbHost = (EspUsbHost *)arg;
 
   esp_err_t err;
+  device_data_t *device;
   switch (eventMsg->event) {
     case USB_HOST_CLIENT_EVENT_NEW_DEV:
       ESP_LOGI("EspUsbHost", "USB_HOST_CLIENT_EVENT_NEW_DEV new_dev.address=%d", eventMsg->new_dev.address);
-      err = usb_host_device_open(usbHost->clientHandle, eventMsg->new_dev.address, &usbHost->deviceHandle);
+
+      // ハブ経由で複数台つながるため、空いているデバイス枠に割り当てる
+      device = usbHost->_allocDevice(eventMsg->new_dev.address);
+      if (device == NULL) {
+        ESP_LOGI("EspUsbHost", "device table full, new_dev.address=%d", eventMsg->new_dev.address);
+        break;
+      }
+
+      err = usb_host_device_open(usbHost->clientHandle, eventMsg->new_dev.address, &device->deviceHandle);
       if (err != ESP_OK) {
         ESP_LOGI("EspUsbHost", "usb_host_device_open() err=%x", err);
+        device->inUse = false;
+        break;
       } else {
-        ESP_LOGI("EspUsbHost", "usb_host_device_open() ESP_OK");
+        ESP_LOGI("EspUsbHost", "usb_host_device_open() ESP_OK device=%d", device->index);
       }
 
       usb_device_info_t dev_info;
-      err = usb_host_device_info(usbHost->deviceHandle, &dev_info);
+      err = usb_host_device_info(device->deviceHandle, &dev_info);
       if (err != ESP_OK) {
         ESP_LOGI("EspUsbHost", "usb_host_device_info() err=%x", err);
       } else {
+        // 製品情報をUTF-8で保存（ログも保存したバッファから出す）
+        getUsbDescString(dev_info.str_desc_manufacturer, usbHost->manufacturer, sizeof(usbHost->manufacturer));
+        getUsbDescString(dev_info.str_desc_product, usbHost->productName, sizeof(usbHost->productName));
+        getUsbDescString(dev_info.str_desc_serial_num, usbHost->serialNumber, sizeof(usbHost->serialNumber));
+
         ESP_LOGI("EspUsbHost", "usb_host_device_info() ESP_OK\n"
                                "# speed                 = %d\n"
                                "# dev_addr              = %d\n"
@@ -90,28 +95,35 @@ void EspUsbHost::_clientEventCallback(const usb_host_client_event_msg_t *eventMs
                  dev_info.dev_addr,
                  dev_info.bMaxPacketSize0,
                  dev_info.bConfigurationValue,
-                 getUsbDescString(dev_info.str_desc_manufacturer).c_str(),
-                 getUsbDescString(dev_info.str_desc_product).c_str(),
-                 getUsbDescString(dev_info.str_desc_serial_num).c_str());
-                 
-        // 製品情報を保存
-        usbHost->manufacturer = getUsbDescString(dev_info.str_desc_manufacturer);
-        usbHost->productName = getUsbDescString(dev_info.str_desc_product);
-        usbHost->serialNumber = getUsbDescString(dev_info.str_desc_serial_num);
+                 usbHost->manufacturer,
+                 usbHost->productName,
+                 usbHost->serialNumber);
+
+        if (dev_info.str_desc_serial_num != NULL) {
+          device->cacheKey.serialHash = UsbDescriptorCache::hash((const uint8_t *)dev_info.str_desc_serial_num->wData, dev_info.str_desc_serial_num->bLength - 2);
+        }
       }
 
       const usb_device_desc_t *dev_desc;
-      err = usb_host_get_device_descriptor(usbHost->deviceHandle, &dev_desc);
+      err = usb_host_get_device_descriptor(device->deviceHandle, &dev_desc);
       if (err != ESP_OK) {
         ESP_LOGI("EspUsbHost", "usb_host_get_device_descriptor() err=%x", err);
       } else {
+#if USB_CAPTURE_ENABLED
+        // 列挙はホストスタック内で済んでいるので、取得済みのディスクリプタからGET_DESCRIPTORの転送を再現して記録する
         const uint8_t setup[8] = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00 };
-        _printPcapText("GET DESCRIPTOR Request DEVICE", 0x000b, 0x00, 0x80, 0x02, sizeof(setup), 0x00, setup);
-        _printPcapText("GET DESCRIPTOR Response DEVICE", 0x0008, 0x01, 0x80, 0x02, sizeof(usb_device_desc_t), 0x03, (const uint8_t *)dev_desc);
+        usbCapture.controlSubmit(device->address, (uintptr_t)dev_desc, setup);
+        usbCapture.controlComplete(device->address, (uintptr_t)dev_desc, true, 0, (const uint8_t *)dev_desc, sizeof(usb_device_desc_t));
+#endif
 
         // ベンダーIDと製品IDを保存
+        device->idVendor = dev_desc->idVendor;
+        device->idProduct = dev_desc->idProduct;
         usbHost->idVendor = dev_desc->idVendor;
         usbHost->idProduct = dev_desc->idProduct;
+        device->cacheKey.idVendor = dev_desc->idVendor;
+        device->cacheKey.idProduct = dev_desc->idProduct;
+        device->cacheKey.bcdDevice = dev_desc->bcdDevice;
 
         ESP_LOGI("EspUsbHost", "usb_host_get_device_descriptor() ESP_OK\n"
                                "#### DESCRIPTOR DEVICE ####\n"
@@ -148,9 +160,9 @@ void EspUsbHost::_clientEventCallback(const usb_host_client_event_msg_t *eventMs
         Serial.printf("\n=== USB DEVICE CONNECTED ===\n");
         Serial.printf("Vendor ID: 0x%04X\n", dev_desc->idVendor);
         Serial.printf("Product ID: 0x%04X\n", dev_desc->idProduct);
-        Serial.printf("Manufacturer: %s\n", usbHost->manufacturer.c_str());
-        Serial.printf("Product: %s\n", usbHost->productName.c_str());
-        Serial.printf("Serial: %s\n", usbHost->serialNumber.c_str());
+        Serial.printf("Manufacturer: %s\n", usbHost->manufacturer);
+        Serial.printf("Product: %s\n", usbHost->productName);
+        Serial.printf("Serial: %s\n", usbHost->serialNumber);
         Serial.printf("===========================\n\n");
         
         // デバイス検出イベントを発生させる
@@ -158,14 +170,10 @@ void EspUsbHost::_clientEventCallback(const usb_host_client_event_msg_t *eventMs
       }
 
       const usb_config_desc_t *config_desc;
-      err = usb_host_get_active_config_descriptor(usbHost->deviceHandle, &config_desc);
+      err = usb_host_get_active_config_descriptor(device->deviceHandle, &config_desc);
       if (err != ESP_OK) {
         ESP_LOGI("EspUsbHost", "usb_host_get_active_config_descriptor() err=%x", err);
       } else {
-        const uint8_t setup[8] = { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, 0x09, 0x00 };
-        _printPcapText("GET DESCRIPTOR Request CONFIGURATION", 0x000b, 0x00, 0x80, 0x02, sizeof(setup), 0x00, setup);
-        _printPcapText("GET DESCRIPTOR Response CONFIGURATION", 0x0008, 0x01, 0x80, 0x02, sizeof(usb_config_desc_t), 0x03, (const uint8_t *)config_desc);
-
         ESP_LOGI("EspUsbHost", "usb_host_get_active_config_descriptor() ESP_OK\n"
                                "# bLength             = %d\n"
                                "# bDescriptorType     = %d\n"
@@ -184,49 +192,95 @@ void EspUsbHost::_clientEventCallback(const usb_host_client_event_msg_t *eventMs
                  config_desc->bmAttributes,
                  config_desc->bMaxPower * 2);
       }
+      if (err != ESP_OK) {
+        break;
+      }
+
+      // 構成まで一致する既知のデバイスなら、レポートディスクリプタをキャッシュから復元して制御転送を省く
+      device->cacheKey.configHash = UsbDescriptorCache::hash((const uint8_t *)config_desc, config_desc->wTotalLength);
+      device->cacheHit = usbHost->descriptorCache.contains(device->cacheKey);
+      ESP_LOGI("EspUsbHost", "descriptor cache %s device=%d", device->cacheHit ? "hit" : "miss", device->index);
 
+      usbHost->_configDevice = device;
       usbHost->_configCallback(config_desc);
+      usbHost->_configDevice = NULL;
       break;
 
     case USB_HOST_CLIENT_EVENT_DEV_GONE:
       {
         ESP_LOGI("EspUsbHost", "USB_HOST_CLIENT_EVENT_DEV_GONE dev_gone.dev_hdl=%x", eventMsg->dev_gone.dev_hdl);
-        for (int i = 0; i < usbHost->usbTransferSize; i++) {
-          if (usbHost->usbTransfer[i] == NULL) {
+
+        device = usbHost->_findDevice(eventMsg->dev_gone.dev_hdl);
+        if (device == NULL) {
+          ESP_LOGI("EspUsbHost", "unknown dev_hdl=%x", eventMsg->dev_gone.dev_hdl);
+          break;
+        }
+
+        // 完了コールバックからの再投入を止めてから転送を解放する
+        device->isReady = false;
+
+        // 押下中のキーを解放させるため、コンシューマへ切断を通知する（長さ0のレポート）
+        // レポート表の消去と枠の返却はコンシューマが通知を処理したあとに行う
+        device->releasing.store(true, std::memory_order_release);
+        usb_report_t *slot = usbHost->reportRing.acquire();
+        if (slot != NULL) {
+          slot->timestamp_us = esp_timer_get_time();
+          slot->deviceIndex = device->index;
+          slot->bEndpointAddress = 0;
+          slot->length = 0;
+          usbHost->reportRing.commit();
+        } else {
+          device->goneLost.store(true, std::memory_order_release);
+        }
+
+        for (int i = 0; i < device->usbTransferSize; i++) {
+          if (device->usbTransfer[i] == NULL) {
             continue;
           }
 
-          err = usb_host_endpoint_clear(eventMsg->dev_gone.dev_hdl, usbHost->usbTransfer[i]->bEndpointAddress);
+          usb_host_endpoint_halt(eventMsg->dev_gone.dev_hdl, device->usbTransfer[i]->bEndpointAddress);
+          usb_host_endpoint_flush(eventMsg->dev_gone.dev_hdl, device->usbTransfer[i]->bEndpointAddress);
+
+          err = usb_host_endpoint_clear(eventMsg->dev_gone.dev_hdl, device->usbTransfer[i]->bEndpointAddress);
           if (err != ESP_OK) {
-            ESP_LOGI("EspUsbHost", "usb_host_endpoint_clear() err=%x, dev_hdl=%x, bEndpointAddress=%x", err, eventMsg->dev_gone.dev_hdl, usbHost->usbTransfer[i]->bEndpointAddress);
+            ESP_LOGI("EspUsbHost", "usb_host_endpoint_clear() err=%x, dev_hdl=%x, bEndpointAddress=%x", err, eventMsg->dev_gone.dev_hdl, device->usbTransfer[i]->bEndpointAddress);
           } else {
-            ESP_LOGI("EspUsbHost", "usb_host_endpoint_clear() ESP_OK, dev_hdl=%x, bEndpointAddress=%x", eventMsg->dev_gone.dev_hdl, usbHost->usbTransfer[i]->bEndpointAddress);
+            ESP_LOGI("EspUsbHost", "usb_host_endpoint_clear() ESP_OK, dev_hdl=%x, bEndpointAddress=%x", eventMsg->dev_gone.dev_hdl, device->usbTransfer[i]->bEndpointAddress);
           }
 
-          err = usb_host_transfer_free(usbHost->usbTransfer[i]);
+          err = usb_host_transfer_free(device->usbTransfer[i]);
           if (err != ESP_OK) {
-            ESP_LOGI("EspUsbHost", "usb_host_transfer_free() err=%x, err, usbTransfer=%x", err, usbHost->usbTransfer[i]);
+            ESP_LOGI("EspUsbHost", "usb_host_transfer_free() err=%x, err, usbTransfer=%x", err, device->usbTransfer[i]);
           } else {
-            ESP_LOGI("EspUsbHost", "usb_host_transfer_free() ESP_OK, usbTransfer=%x", usbHost->usbTransfer[i]);
+            ESP_LOGI("EspUsbHost", "usb_host_transfer_free() ESP_OK, usbTransfer=%x", device->usbTransfer[i]);
           }
 
-          usbHost->usbTransfer[i] = NULL;
+          device->usbTransfer[i] = NULL;
         }
-        usbHost->usbTransferSize = 0;
+        device->usbTransferSize = 0;
 
-        for (int i = 0; i < usbHost->usbInterfaceSize; i++) {
-          err = usb_host_interface_release(usbHost->clientHandle, usbHost->deviceHandle, usbHost->usbInterface[i]);
+        for (int i = 0; i < device->usbInterfaceSize; i++) {
+          err = usb_host_interface_release(usbHost->clientHandle, device->deviceHandle, device->usbInterface[i]);
           if (err != ESP_OK) {
-            ESP_LOGI("EspUsbHost", "usb_host_interface_release() err=%x, err, clientHandle=%x, deviceHandle=%x, Interface=%x", err, usbHost->clientHandle, usbHost->deviceHandle, usbHost->usbInterface[i]);
+            ESP_LOGI("EspUsbHost", "usb_host_interface_release() err=%x, err, clientHandle=%x, deviceHandle=%x, Interface=%x", err, usbHost->clientHandle, device->deviceHandle, device->usbInterface[i]);
           } else {
-            ESP_LOGI("EspUsbHost", "usb_host_interface_release() ESP_OK, clientHandle=%x, deviceHandle=%x, Interface=%x", usbHost->clientHandle, usbHost->deviceHandle, usbHost->usbInterface[i]);
+            ESP_LOGI("EspUsbHost", "usb_host_interface_release() ESP_OK, clientHandle=%x, deviceHandle=%x, Interface=%x", usbHost->clientHandle, device->deviceHandle, device->usbInterface[i]);
           }
 
-          usbHost->usbInterface[i] = 0;
+          device->usbInterface[i] = 0;
         }
-        usbHost->usbInterfaceSize = 0;
+        device->usbInterfaceSize = 0;
 
-        usb_host_device_close(usbHost->clientHandle, usbHost->deviceHandle);
+        usb_host_device_close(usbHost->clientHandle, device->deviceHandle);
+        device->inUse = false;
+
+        // 残りのデバイスに受信可能なものがあるか
+        usbHost->isReady = false;
+        for (int i = 0; i < USB_HOST_MAX_DEVICES; i++) {
+          if (usbHost->devices[i].inUse && usbHost->devices[i].isReady) {
+            usbHost->isReady = true;
+          }
+        }
 
         usbHost->onGone(eventMsg);
       }
@@ -242,9 +296,13 @@ void EspUsbHost::_configCallback(const usb_config_desc_t *config_desc) {
   const uint8_t *p = &config_desc->val[0];
   uint8_t bLength;
 
-  const uint8_t setup[8] = { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, (uint8_t)config_desc->wTotalLength, 0x00 };
-  _printPcapText("GET DESCRIPTOR Request CONFIGURATION", 0x000b, 0x00, 0x80, 0x02, sizeof(setup), 0x00, setup);
-  _printPcapText("GET DESCRIPTOR Response CONFIGURATION", 0x0008, 0x01, 0x80, 0x02, config_desc->wTotalLength, 0x03, (const uint8_t *)config_desc);
+#if USB_CAPTURE_ENABLED
+  if (this->_configDevice != NULL) {
+    const uint8_t setup[8] = { 0x80, 0x06, 0x00, 0x02, 0x00, 0x00, (uint8_t)(config_desc->wTotalLength & 0xff), (uint8_t)(config_desc->wTotalLength >> 8) };
+    usbCapture.controlSubmit(this->_configDevice->address, (uintptr_t)config_desc, setup);
+    usbCapture.controlComplete(this->_configDevice->address, (uintptr_t)config_desc, true, 0, (const uint8_t *)config_desc, config_desc->wTotalLength);
+  }
+#endif
 
   for (int i = 0; i < config_desc->wTotalLength; i += bLength, p += bLength) {
     bLength = *p;
@@ -252,12 +310,76 @@ void EspUsbHost::_configCallback(const usb_config_desc_t *config_desc) {
       const uint8_t bDescriptorType = *(p + 1);
       this->onConfig(bDescriptorType, p);
     } else {
-      return;
+      break;
+    }
+  }
+
+  if (this->_configDevice != NULL && this->_configDevice->isReady) {
+    _submitTransfers(this->_configDevice);
+    _flushLeds();
+    ESP_LOGI("EspUsbHost", "device=%d ready in %dus (%s)", this->_configDevice->index,
+             (int)(esp_timer_get_time() - this->_configDevice->connectedUs),
+             this->_configDevice->cacheHit ? "cached" : "full enumeration");
+  }
+}
+
+void EspUsbHost::beginTask(BaseType_t core, UBaseType_t priority) {
+  // USBホストライブラリとクライアントのイベント処理を専用タスクに移す
+  // どちらもイベント待ちでブロックするため、loop()の処理内容に左右されない
+  if (this->libTaskHandle != NULL || this->clientTaskHandle != NULL) {
+    return;
+  }
+
+  BaseType_t ret = xTaskCreatePinnedToCore(_libTask, "usb_host_lib", USB_HOST_TASK_STACK_SIZE, this, priority, &this->libTaskHandle, core);
+  if (ret != pdPASS) {
+    ESP_LOGI("EspUsbHost", "xTaskCreatePinnedToCore(usb_host_lib) err=%d", ret);
+    this->libTaskHandle = NULL;
+    return;
+  }
+
+  ret = xTaskCreatePinnedToCore(_clientTask, "usb_host_client", USB_HOST_TASK_STACK_SIZE, this, priority, &this->clientTaskHandle, core);
+  if (ret != pdPASS) {
+    ESP_LOGI("EspUsbHost", "xTaskCreatePinnedToCore(usb_host_client) err=%d", ret);
+    this->clientTaskHandle = NULL;
+    return;
+  }
+
+  ESP_LOGI("EspUsbHost", "USB host tasks started core=%d priority=%d", core, priority);
+}
+
+void EspUsbHost::_libTask(void *arg) {
+  EspUsbHost *usbHost = (EspUsbHost *)arg;
+
+  for (;;) {
+    esp_err_t err = usb_host_lib_handle_events(portMAX_DELAY, &usbHost->eventFlags);
+    if (err != ESP_OK && err != ESP_ERR_TIMEOUT) {
+      ESP_LOGI("EspUsbHost", "usb_host_lib_handle_events() err=%x eventFlags=%x", err, usbHost->eventFlags);
     }
   }
 }
 
+void EspUsbHost::_clientTask(void *arg) {
+  EspUsbHost *usbHost = (EspUsbHost *)arg;
+
+  for (;;) {
+    // INエンドポイントの転送は完了コールバックから再投入するため、ここでは常にイベント待ちでブロックする
+    esp_err_t err = usb_host_client_handle_events(usbHost->clientHandle, portMAX_DELAY);
+    if (err != ESP_OK && err != ESP_ERR_TIMEOUT) {
+      ESP_LOGI("EspUsbHost", "usb_host_client_handle_events() err=%x", err);
+    }
+
+    // setKeyboardLeds()や復旧タイマで起こされた場合の処理
+    usbHost->_flushLeds();
+    usbHost->_resumeEndpoints();
+  }
+}
+
 void EspUsbHost::task(void) {
+  // 専用タスクで動作中はloop()からのポーリングは不要
+  if (this->clientTaskHandle != NULL) {
+    return;
+  }
+
   esp_err_t err = usb_host_lib_handle_events(1, &this->eventFlags);
   if (err != ESP_OK && err != ESP_ERR_TIMEOUT) {
     ESP_LOGI("EspUsbHost", "usb_host_lib_handle_events() err=%x eventFlags=%x", err, this->eventFlags);
@@ -268,41 +390,390 @@ void EspUsbHost::task(void) {
     ESP_LOGI("EspUsbHost", "usb_host_client_handle_events() err=%x", err);
   }
 
-  if (this->isReady) {
-    unsigned long now = millis();
-    if ((now - this->lastCheck) > this->interval) {
-      this->lastCheck = now;
+  _flushLeds();
+  _resumeEndpoints();
+}
+
+void EspUsbHost::setKeyboardLeds(uint8_t leds) {
+  this->requestedLeds.store(leds, std::memory_order_relaxed);
+  // 制御転送はUSBクライアントタスクから投入するので、イベント待ちを解いて任せる
+  if (this->clientTaskHandle != NULL) {
+    usb_host_client_unblock(this->clientHandle);
+  }
+}
+
+void EspUsbHost::_flushLeds(void) {
+  uint8_t leds = this->requestedLeds.load(std::memory_order_relaxed);
+  for (int i = 0; i < USB_HOST_MAX_DEVICES; i++) {
+    device_data_t *device = &this->devices[i];
+    // 送信中なら完了時に最新値でもう一度呼ばれる（途中の変化はまとめて捨てる）
+    if (!device->inUse || !device->isReady || device->ledsInFlight > 0 || device->ledsSent == leds) {
+      continue;
+    }
+    device->ledsInFlight = _sendLeds(device, leds);
+    if (device->ledsInFlight > 0) {
+      device->ledsSent = leds;
+    }
+  }
+}
 
-      for (int i = 0; i < this->usbTransferSize; i++) {
-        if (this->usbTransfer[i] == NULL) {
+uint8_t EspUsbHost::_sendLeds(device_data_t *device, uint8_t leds) {
+  uint8_t sent = 0;
+  for (int n = 0; n < device->usbInterfaceSize; n++) {
+    uint8_t bInterfaceNumber = device->usbInterface[n];
+    const hid_report_map_t *map = getReportMap(device, bInterfaceNumber);
+    uint8_t payload[9];  // レポートID + 8バイト
+
+    if (map != NULL) {
+      // LEDページの出力レポートを持つインターフェースへ、そのレイアウトで送る
+      for (uint8_t r = 0; r < map->report_count; r++) {
+        const hid_report_info_t &info = map->reports[r];
+        if (info.type != HID_REPORT_TYPE_OUTPUT || !map->hasUsagePage(info, HID_USAGE_PAGE_LED)) {
           continue;
         }
+        uint16_t length = map->encodeUsageBits(info, HID_USAGE_PAGE_LED, leds, payload, sizeof(payload));
+        if (length > 0 && hidSetReport(device, bInterfaceNumber, HID_REPORT_TYPE_OUTPUT, info.report_id, payload, length) == ESP_OK) {
+          sent++;
+        }
+        break;
+      }
+      continue;
+    }
+
+    // レポートディスクリプタのないブートキーボードは1バイトの固定配置
+    for (int ep = 0; ep < 17; ep++) {
+      const endpoint_data_t &endpoint_data = device->endpoint_data_list[ep];
+      if (endpoint_data.decoderType == USB_DECODER_KEYBOARD && endpoint_data.bInterfaceNumber == bInterfaceNumber) {
+        payload[0] = leds;
+        if (hidSetReport(device, bInterfaceNumber, HID_REPORT_TYPE_OUTPUT, 0, payload, 1) == ESP_OK) {
+          sent++;
+        }
+        break;
+      }
+    }
+  }
+  return sent;
+}
+
+void EspUsbHost::_submitTransfers(device_data_t *device) {
+  // 列挙完了時に全IN転送を一度だけ投入する（以降は_onReceive()で再投入）
+  for (int i = 0; i < device->usbTransferSize; i++) {
+    if (device->usbTransfer[i] == NULL) {
+      continue;
+    }
+
+    esp_err_t err = _submitInterrupt(device, device->usbTransfer[i]);
+    if (err != ESP_OK) {
+      this->taskStats.submitErrors++;
+      device->submitErrors++;
+      ESP_LOGI("EspUsbHost", "usb_host_transfer_submit() err=%x device=%d bEndpointAddress=%x", err, device->index, device->usbTransfer[i]->bEndpointAddress);
+    }
+  }
+}
+
+esp_err_t EspUsbHost::_submitInterrupt(device_data_t *device, usb_transfer_t *transfer) {
+  esp_err_t err = usb_host_transfer_submit(transfer);
+#if USB_CAPTURE_ENABLED
+  // 完了は同じクライアントタスクで処理されるので、投入後に記録してもSubmitが先に並ぶ
+  if (err == ESP_OK) {
+    usbCapture.interruptSubmit(device->address, transfer->bEndpointAddress, (uintptr_t)transfer, transfer->num_bytes,
+                               device->endpoint_data_list[(transfer->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK)].bInterval);
+  }
+#endif
+  return err;
+}
+
+void EspUsbHost::_haltEndpoint(device_data_t *device, endpoint_data_t *endpoint_data, uint8_t bEndpointAddress, usb_transfer_status_t status) {
+  if (status == USB_TRANSFER_STATUS_STALL) {
+    endpoint_data->stallCount++;
+  } else if (status == USB_TRANSFER_STATUS_TIMED_OUT) {
+    endpoint_data->timeoutCount++;
+  } else {
+    endpoint_data->errorCount++;
+  }
+  if (endpoint_data->recovering) {
+    return;
+  }
+
+  // 待ち時間は連続したエラーの数に応じて倍にする（上限あり）
+  uint32_t delayUs = USB_HOST_RETRY_BASE_US << (endpoint_data->errorStreak < 16 ? endpoint_data->errorStreak : 16);
+  if (delayUs > USB_HOST_RETRY_MAX_US) {
+    delayUs = USB_HOST_RETRY_MAX_US;
+  }
+  if (endpoint_data->errorStreak < 255) {
+    endpoint_data->errorStreak++;
+  }
+
+  int64_t now = esp_timer_get_time();
+  endpoint_data->recovering = true;
+  endpoint_data->errorUs = now;
+  endpoint_data->resumeAtUs = now + delayUs;
+  ESP_LOGI("EspUsbHost", "endpoint error device=%d bEndpointAddress=0x%x status=%d retry in %uus",
+           device->index, bEndpointAddress, status, delayUs);
+
+  // 残りの転送も回収し（CANCELEDで戻ってくる）、パイプのエラー状態を解除できるようにする
+  usb_host_endpoint_halt(device->deviceHandle, bEndpointAddress);
+  usb_host_endpoint_flush(device->deviceHandle, bEndpointAddress);
+
+  // STALLはデバイス側のHaltも解除する（CLEAR_FEATURE(ENDPOINT_HALT)、完了するまで投入し直さない）
+  if (status == USB_TRANSFER_STATUS_STALL) {
+    endpoint_data->clearPending = (submitControlRequest(device, 0x02, 0x01, 0x0000, bEndpointAddress, 0) == ESP_OK);
+  }
+
+  _scheduleRetry(endpoint_data->resumeAtUs, now);
+}
+
+void EspUsbHost::_resumeEndpoints(void) {
+  int64_t now = esp_timer_get_time();
+  int64_t nextUs = INT64_MAX;
+
+  for (int d = 0; d < USB_HOST_MAX_DEVICES; d++) {
+    device_data_t *device = &this->devices[d];
+    if (!device->inUse || !device->isReady) {
+      continue;
+    }
+    for (int ep = 1; ep < 17; ep++) {
+      endpoint_data_t *endpoint_data = &device->endpoint_data_list[ep];
+      if (!endpoint_data->recovering) {
+        continue;
+      }
+      // 時刻前、CLEAR_FEATURE待ち、または回収しきれていない転送があればまだ待つ
+      if (now < endpoint_data->resumeAtUs || endpoint_data->clearPending || endpoint_data->parkedCount < endpoint_data->transferCount) {
+        if (now < endpoint_data->resumeAtUs && endpoint_data->resumeAtUs < nextUs) {
+          nextUs = endpoint_data->resumeAtUs;
+        }
+        continue;
+      }
+
+      uint8_t bEndpointAddress = 0;
+      for (int i = 0; i < device->usbTransferSize; i++) {
+        if (device->usbTransfer[i] != NULL && (device->usbTransfer[i]->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK) == ep) {
+          bEndpointAddress = device->usbTransfer[i]->bEndpointAddress;
+          break;
+        }
+      }
+      usb_host_endpoint_clear(device->deviceHandle, bEndpointAddress);
+
+      endpoint_data->recovering = false;
+      endpoint_data->parkedCount = 0;
+      endpoint_data->recoveryCount++;
+      endpoint_data->lastRecoveryUs = (uint32_t)(now - endpoint_data->errorUs);
+      ESP_LOGI("EspUsbHost", "endpoint resumed device=%d bEndpointAddress=0x%x after %uus", device->index, bEndpointAddress, endpoint_data->lastRecoveryUs);
 
-        esp_err_t err = usb_host_transfer_submit(this->usbTransfer[i]);
-        if (err != ESP_OK && err != ESP_ERR_NOT_FINISHED && err != ESP_ERR_INVALID_STATE) {
-          //ESP_LOGI("EspUsbHost", "usb_host_transfer_submit() err=%x", err);
+      for (int i = 0; i < device->usbTransferSize; i++) {
+        usb_transfer_t *transfer = device->usbTransfer[i];
+        if (transfer == NULL || transfer->bEndpointAddress != bEndpointAddress) {
+          continue;
+        }
+        if (endpoint_data->recovering) {
+          // 直前の投入に失敗して再び復旧待ちになった
+          endpoint_data->parkedCount++;
+          continue;
+        }
+        esp_err_t err = _submitInterrupt(device, transfer);
+        if (err != ESP_OK) {
+          this->taskStats.submitErrors++;
+          device->submitErrors++;
+          // 投入できなかった転送は止めたまま、もう一度待つ
+          _haltEndpoint(device, endpoint_data, bEndpointAddress, USB_TRANSFER_STATUS_ERROR);
+          endpoint_data->parkedCount++;
         }
       }
     }
   }
+
+  // 時刻待ちのエンドポイントが残っていれば、その時刻にもう一度起こす
+  if (nextUs != INT64_MAX) {
+    _scheduleRetry(nextUs, now);
+  }
+}
+
+void EspUsbHost::_scheduleRetry(int64_t atUs, int64_t now) {
+  // タイマは1つなので、もっと早い時刻にかかっていればそのままにする（起きたら_resumeEndpoints()がかけ直す）
+  if (this->retryTimer == NULL || (this->retryTimerAtUs > now && this->retryTimerAtUs <= atUs)) {
+    return;
+  }
+  esp_timer_stop(this->retryTimer);
+  esp_timer_start_once(this->retryTimer, (uint64_t)(atUs > now ? atUs - now : 0));
+  this->retryTimerAtUs = atUs;
+}
+
+void EspUsbHost::_retryTimerCallback(void *arg) {
+  EspUsbHost *usbHost = (EspUsbHost *)arg;
+  if (usbHost->clientTaskHandle != NULL) {
+    usb_host_client_unblock(usbHost->clientHandle);
+  }
+}
+
+EspUsbHost::device_data_t *EspUsbHost::_allocDevice(uint8_t address) {
+  for (int i = 0; i < USB_HOST_MAX_DEVICES; i++) {
+    device_data_t *device = &this->devices[i];
+    if (device->inUse || device->releasing.load(std::memory_order_acquire)) {
+      continue;
+    }
+
+    device->inUse = true;
+    device->isReady = false;
+    device->address = address;
+    device->deviceHandle = NULL;
+    device->idVendor = 0;
+    device->idProduct = 0;
+    memset(&device->cacheKey, 0, sizeof(device->cacheKey));
+    device->cacheHit = false;
+    memset(device->usbTransfer, 0, sizeof(device->usbTransfer));
+    device->usbTransferSize = 0;
+    device->usbInterfaceSize = 0;
+    memset(device->endpoint_data_list, 0, sizeof(device->endpoint_data_list));
+    for (int n = 0; n < USB_HOST_MAX_INTERFACES; n++) {
+      device->reportMap[n].clear();
+      device->interfaceKeys[n].clear();
+    }
+    device->connectedUs = esp_timer_get_time();
+    device->reportCount = 0;
+    device->overflowCount = 0;
+    device->submitErrors = 0;
+    device->keyPressCount = 0;
+    device->controlErrors = 0;
+    device->ledsSent = 0;
+    device->ledsInFlight = 0;
+    return device;
+  }
+  return NULL;
 }
 
-String EspUsbHost::getUsbDescString(const usb_str_desc_t *str_desc) {
-  String str = "";
-  if (str_desc == NULL) {
-    return str;
+EspUsbHost::device_data_t *EspUsbHost::_findDevice(usb_device_handle_t deviceHandle) {
+  for (int i = 0; i < USB_HOST_MAX_DEVICES; i++) {
+    if (this->devices[i].inUse && this->devices[i].deviceHandle == deviceHandle) {
+      return &this->devices[i];
+    }
   }
+  return NULL;
+}
 
-  for (int i = 0; i < str_desc->bLength / 2; i++) {
-    if (str_desc->wData[i] > 0xFF) {
+EspUsbHost::endpoint_data_t *EspUsbHost::getEndpointData(const usb_report_t &raw) {
+  return &this->devices[raw.deviceIndex].endpoint_data_list[(raw.bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK)];
+}
+
+void EspUsbHost::printTaskStats(void) {
+  uint32_t count = this->taskStats.callbackCount;
+  uint32_t avg = (count > 0) ? (uint32_t)(this->taskStats.totalCallbackUs / count) : 0;
+  Serial.printf("[USB] task=%s callbacks=%u last=%uus avg=%uus max=%uus submitErrors=%u\n",
+                (this->clientTaskHandle != NULL) ? "pinned" : "loop",
+                count,
+                this->taskStats.lastCallbackUs,
+                avg,
+                this->taskStats.maxCallbackUs,
+                this->taskStats.submitErrors);
+  Serial.printf("[USB] ring=%u/%u highWater=%u overflow=%u queueLatency last=%uus max=%uus\n",
+                this->reportRing.size(),
+                this->reportRing.capacity(),
+                this->reportRing.highWaterMark(),
+                this->reportRing.overflowCount(),
+                this->lastQueueLatencyUs,
+                this->maxQueueLatencyUs);
+
+  for (int d = 0; d < USB_HOST_MAX_DEVICES; d++) {
+    const device_data_t *device = &this->devices[d];
+    if (!device->inUse) {
       continue;
     }
-    str += char(str_desc->wData[i]);
+    Serial.printf("[USB] DEV%d addr=%d VID=0x%04X PID=0x%04X uptime=%ums reports=%u overflow=%u submitErrors=%u controlErrors=%u keyPress=%u\n",
+                  d,
+                  device->address,
+                  device->idVendor,
+                  device->idProduct,
+                  (uint32_t)((esp_timer_get_time() - device->connectedUs) / 1000),
+                  device->reportCount,
+                  device->overflowCount,
+                  device->submitErrors,
+                  device->controlErrors,
+                  device->keyPressCount);
+
+    for (int i = 0; i < 17; i++) {
+      const endpoint_data_t *endpoint_data = &device->endpoint_data_list[i];
+      if (endpoint_data->reportCount == 0) {
+        continue;
+      }
+      Serial.printf("[USB]   EP%d bInterval=%ums reports=%u gap min=%uus max=%uus decoder=%d decoded=%u unchanged=%u stall=%u timeout=%u error=%u recovered=%u last=%uus\n",
+                    i,
+                    endpoint_data->bInterval,
+                    endpoint_data->reportCount,
+                    endpoint_data->minGapUs,
+                    endpoint_data->maxGapUs,
+                    endpoint_data->decoderType,
+                    endpoint_data->decodedCount,
+                    endpoint_data->unchangedCount,
+                    endpoint_data->stallCount,
+                    endpoint_data->timeoutCount,
+                    endpoint_data->errorCount,
+                    endpoint_data->recoveryCount,
+                    endpoint_data->lastRecoveryUs);
+    }
+  }
+}
+
+size_t EspUsbHost::getUsbDescString(const usb_str_desc_t *str_desc, char *out, size_t size) {
+  // UTF-16LEの文字列ディスクリプタをUTF-8へ変換して終端する（書いたバイト数を返す）
+  // 入りきらない文字は途中で切らずに捨て、不正なサロゲートはU+FFFDに置き換える
+  if (out == NULL || size == 0) {
+    return 0;
+  }
+  size_t len = 0;
+  out[0] = '\0';
+  if (str_desc == NULL || str_desc->bLength < 2) {
+    return 0;
+  }
+
+  int count = (str_desc->bLength - 2) / 2;
+  for (int i = 0; i < count; i++) {
+    uint32_t cp = str_desc->wData[i];
+    if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < count && str_desc->wData[i + 1] >= 0xDC00 && str_desc->wData[i + 1] <= 0xDFFF) {
+      cp = 0x10000 + ((cp - 0xD800) << 10) + (str_desc->wData[i + 1] - 0xDC00);
+      i++;
+    } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+      cp = 0xFFFD;
+    }
+    if (cp == 0) {
+      break;
+    }
+
+    uint8_t utf8[4];
+    size_t n;
+    if (cp < 0x80) {
+      utf8[0] = cp;
+      n = 1;
+    } else if (cp < 0x800) {
+      utf8[0] = 0xC0 | (cp >> 6);
+      utf8[1] = 0x80 | (cp & 0x3F);
+      n = 2;
+    } else if (cp < 0x10000) {
+      utf8[0] = 0xE0 | (cp >> 12);
+      utf8[1] = 0x80 | ((cp >> 6) & 0x3F);
+      utf8[2] = 0x80 | (cp & 0x3F);
+      n = 3;
+    } else {
+      utf8[0] = 0xF0 | (cp >> 18);
+      utf8[1] = 0x80 | ((cp >> 12) & 0x3F);
+      utf8[2] = 0x80 | ((cp >> 6) & 0x3F);
+      utf8[3] = 0x80 | (cp & 0x3F);
+      n = 4;
+    }
+    if (len + n >= size) {
+      break;
+    }
+    memcpy(out + len, utf8, n);
+    len += n;
   }
-  return str;
+  out[len] = '\0';
+  return len;
 }
 
 void EspUsbHost::onConfig(const uint8_t bDescriptorType, const uint8_t *p) {
+  device_data_t *device = this->_configDevice;
+  if (device == NULL) {
+    return;
+  }
+
   switch (bDescriptorType) {
     case USB_DEVICE_DESC:
       {
@@ -377,13 +848,15 @@ void EspUsbHost::onConfig(const uint8_t bDescriptorType, const uint8_t *p) {
                  intf->bInterfaceProtocol,
                  intf->iInterface);
 
-        this->claim_err = usb_host_interface_claim(this->clientHandle, this->deviceHandle, intf->bInterfaceNumber, intf->bAlternateSetting);
+        this->claim_err = usb_host_interface_claim(this->clientHandle, device->deviceHandle, intf->bInterfaceNumber, intf->bAlternateSetting);
         if (this->claim_err != ESP_OK) {
           ESP_LOGI("EspUsbHost", "usb_host_interface_claim() err=%x", claim_err);
         } else {
           ESP_LOGI("EspUsbHost", "usb_host_interface_claim() ESP_OK");
-          this->usbInterface[this->usbInterfaceSize] = intf->bInterfaceNumber;
-          this->usbInterfaceSize++;
+          if (device->usbInterfaceSize < sizeof(device->usbInterface)) {
+            device->usbInterface[device->usbInterfaceSize] = intf->bInterfaceNumber;
+            device->usbInterfaceSize++;
+          }
           _bInterfaceNumber = intf->bInterfaceNumber;
           _bInterfaceClass = intf->bInterfaceClass;
           _bInterfaceSubClass = intf->bInterfaceSubClass;
@@ -418,11 +891,11 @@ void EspUsbHost::onConfig(const uint8_t bDescriptorType, const uint8_t *p) {
           return;
         }
 
-        this->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceNumber = _bInterfaceNumber;
-        this->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceClass = _bInterfaceClass;
-        this->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceSubClass = _bInterfaceSubClass;
-        this->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceProtocol = _bInterfaceProtocol;
-        this->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bCountryCode = _bCountryCode;
+        device->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceNumber = _bInterfaceNumber;
+        device->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceClass = _bInterfaceClass;
+        device->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceSubClass = _bInterfaceSubClass;
+        device->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bInterfaceProtocol = _bInterfaceProtocol;
+        device->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)].bCountryCode = _bCountryCode;
 
         if ((ep_desc->bmAttributes & USB_BM_ATTRIBUTES_XFERTYPE_MASK) != USB_BM_ATTRIBUTES_XFER_INT) {
           ESP_LOGI("EspUsbHost", "err ep_desc->bmAttributes=%x", ep_desc->bmAttributes);
@@ -430,23 +903,59 @@ void EspUsbHost::onConfig(const uint8_t bDescriptorType, const uint8_t *p) {
         }
 
         if (ep_desc->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK) {
-          esp_err_t err = usb_host_transfer_alloc(ep_desc->wMaxPacketSize + 1, 0, &this->usbTransfer[this->usbTransferSize]);
-          if (err != ESP_OK) {
-            this->usbTransfer[this->usbTransferSize] = NULL;
-            ESP_LOGI("EspUsbHost", "usb_host_transfer_alloc() err=%x", err);
-            return;
+          endpoint_data_t *endpoint_data = &device->endpoint_data_list[USB_EP_DESC_GET_EP_NUM(ep_desc)];
+          endpoint_data->bInterval = ep_desc->bInterval;
+          endpoint_data->lastReportUs = 0;
+          endpoint_data->reportCount = 0;
+          endpoint_data->minGapUs = UINT32_MAX;
+          endpoint_data->maxGapUs = 0;
+
+          // デコーダを列挙時に一度だけ決めておき、受信ごとのクラス判定をなくす
+          if (_bInterfaceClass != USB_CLASS_HID) {
+            endpoint_data->decoderType = USB_DECODER_NONE;
+            endpoint_data->decoder = NULL;
+          } else if (_bInterfaceSubClass == HID_SUBCLASS_BOOT && _bInterfaceProtocol == HID_ITF_PROTOCOL_KEYBOARD) {
+            endpoint_data->decoderType = USB_DECODER_KEYBOARD;
+            endpoint_data->decoder = _decodeKeyboardReport;
+          } else if (_bInterfaceSubClass == HID_SUBCLASS_BOOT && _bInterfaceProtocol == HID_ITF_PROTOCOL_MOUSE) {
+            endpoint_data->decoderType = USB_DECODER_MOUSE;
+            endpoint_data->decoder = _decodeMouseReport;
           } else {
-            ESP_LOGI("EspUsbHost", "usb_host_transfer_alloc() ESP_OK data_buffer_size=%d", ep_desc->wMaxPacketSize + 1);
+            endpoint_data->decoderType = USB_DECODER_HID;
+            endpoint_data->decoder = _decodeHidReport;
           }
+          endpoint_data->lastReportLength = 0;
+          endpoint_data->lastButtons = 0;
+          endpoint_data->gamepadActive = false;
+          endpoint_data->decodedCount = 0;
+          endpoint_data->unchangedCount = 0;
+
+          // 同じエンドポイントに複数の転送を割り当て、1つが完了しても次が常にバス上で待機するようにする
+          for (int n = 0; n < USB_HOST_IN_TRANSFER_DEPTH; n++) {
+            if (device->usbTransferSize >= USB_HOST_MAX_TRANSFERS) {
+              ESP_LOGI("EspUsbHost", "usbTransfer full, bEndpointAddress=%x", ep_desc->bEndpointAddress);
+              break;
+            }
+
+            esp_err_t err = usb_host_transfer_alloc(ep_desc->wMaxPacketSize + 1, 0, &device->usbTransfer[device->usbTransferSize]);
+            if (err != ESP_OK) {
+              device->usbTransfer[device->usbTransferSize] = NULL;
+              ESP_LOGI("EspUsbHost", "usb_host_transfer_alloc() err=%x", err);
+              return;
+            } else {
+              ESP_LOGI("EspUsbHost", "usb_host_transfer_alloc() ESP_OK data_buffer_size=%d", ep_desc->wMaxPacketSize + 1);
+            }
 
-          this->usbTransfer[this->usbTransferSize]->device_handle = this->deviceHandle;
-          this->usbTransfer[this->usbTransferSize]->bEndpointAddress = ep_desc->bEndpointAddress;
-          this->usbTransfer[this->usbTransferSize]->callback = this->_onReceive;
-          this->usbTransfer[this->usbTransferSize]->context = this;
-          this->usbTransfer[this->usbTransferSize]->num_bytes = ep_desc->wMaxPacketSize;
-          interval = ep_desc->bInterval;
-          isReady = true;
-          this->usbTransferSize++;
+            device->usbTransfer[device->usbTransferSize]->device_handle = device->deviceHandle;
+            device->usbTransfer[device->usbTransferSize]->bEndpointAddress = ep_desc->bEndpointAddress;
+            device->usbTransfer[device->usbTransferSize]->callback = this->_onReceive;
+            device->usbTransfer[device->usbTransferSize]->context = device;
+            device->usbTransfer[device->usbTransferSize]->num_bytes = ep_desc->wMaxPacketSize;
+            device->isReady = true;
+            isReady = true;
+            device->usbTransferSize++;
+            endpoint_data->transferCount++;
+          }
         }
       }
       break;
@@ -496,7 +1005,40 @@ void EspUsbHost::onConfig(const uint8_t bDescriptorType, const uint8_t *p) {
                  hid_desc->wReportLength);
         _bCountryCode = hid_desc->bCountryCode;
 
-        submitControl(0x81, 0x00, 0x22, _bInterfaceNumber, hid_desc->wReportLength);
+        // ブートサブクラスはプロトコルを明示し、SET_IDLE(0)で変化のないレポートの再送を止める
+        // （未対応のデバイスはSTALLを返すだけなので、結果は待たずに次へ進む）
+        uint8_t protocol = USB_HOST_HID_PROTOCOL_KEEP;
+        if (_bInterfaceSubClass == HID_SUBCLASS_BOOT) {
+          protocol = onSelectHidProtocol(device, _bInterfaceNumber, _bInterfaceProtocol);
+          if (protocol != USB_HOST_HID_PROTOCOL_KEEP) {
+            hidSetProtocol(device, _bInterfaceNumber, protocol);
+          }
+        }
+#if USB_HOST_HID_SET_IDLE
+        hidSetIdle(device, _bInterfaceNumber, 0);
+#endif
+        if (protocol == HID_PROTOCOL_BOOT) {
+          // ブートプロトコルのレポートは固定配置なので、レポートディスクリプタは使わない
+          ESP_LOGI("EspUsbHost", "boot protocol device=%d bInterfaceNumber=%d", device->index, _bInterfaceNumber);
+          break;
+        }
+
+        // キャッシュにあればその場で解析し、なければ（または解析できなければ）デバイスから取得する
+        uint16_t cached_length = 0;
+        const uint8_t *cached = NULL;
+        if (device->cacheHit && _bInterfaceNumber < USB_HOST_MAX_INTERFACES) {
+          cached = descriptorCache.findReport(device->cacheKey, _bInterfaceNumber, &cached_length);
+        }
+        if (cached != NULL && cached_length == hid_desc->wReportLength && device->reportMap[_bInterfaceNumber].parse(cached, cached_length)) {
+          ESP_LOGI("EspUsbHost", "HID report map from cache device=%d bInterfaceNumber=%d reports=%d fields=%d", device->index, _bInterfaceNumber,
+                   device->reportMap[_bInterfaceNumber].report_count, device->reportMap[_bInterfaceNumber].field_count);
+        } else {
+          // 途中まで解析した表は公開せずに捨てる（取得後の解析はIN転送の開始後なので、未公開の表へ書く）
+          if (_bInterfaceNumber < USB_HOST_MAX_INTERFACES) {
+            device->reportMap[_bInterfaceNumber].clear();
+          }
+          submitControl(0x81, 0x00, 0x22, _bInterfaceNumber, hid_desc->wReportLength);
+        }
       }
       break;
 
@@ -522,146 +1064,543 @@ void EspUsbHost::onConfig(const uint8_t bDescriptorType, const uint8_t *p) {
 }
 
 void EspUsbHost::_onReceive(usb_transfer_t *transfer) {
-  EspUsbHost *usbHost = (EspUsbHost *)transfer->context;
-  endpoint_data_t *endpoint_data = &usbHost->endpoint_data_list[(transfer->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK)];
-
-  // デバッグ出力
-  #if (defined(USB_DEBUG_DETAIL) && USB_DEBUG_DETAIL == 1)
-  {
-    String buffer_str = "";
-    for (int i = 0; i < transfer->actual_num_bytes; i++) {
-      if (transfer->data_buffer[i] < 16) {
-        buffer_str += "0";
+  device_data_t *device = (device_data_t *)transfer->context;
+  EspUsbHost *usbHost = device->usbHost;
+  int64_t startUs = esp_timer_get_time();
+
+#if USB_CAPTURE_ENABLED
+  usbCapture.interruptComplete(device->address, transfer->bEndpointAddress, (uintptr_t)transfer, startUs,
+                               UsbCapture::transferStatus(transfer->status), transfer->data_buffer, transfer->actual_num_bytes,
+                               device->endpoint_data_list[(transfer->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK)].bInterval);
+#endif
+
+  endpoint_data_t *endpoint_data = &device->endpoint_data_list[(transfer->bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK)];
+
+  // USBタスク内では生レポートと時刻をリングへコピーするだけにする
+  // デコード・BLE送信・表示などはすべてprocessReports()側で行う
+  // （エラーで終わった転送のバッファは前回の内容が残っていることがあるので使わない）
+  if (transfer->status == USB_TRANSFER_STATUS_COMPLETED && transfer->actual_num_bytes > 0) {
+    usb_report_t *slot = usbHost->reportRing.acquire();
+    if (slot != NULL) {
+      uint8_t length = (transfer->actual_num_bytes > USB_REPORT_MAX_SIZE) ? USB_REPORT_MAX_SIZE : transfer->actual_num_bytes;
+      slot->timestamp_us = startUs;
+      slot->deviceIndex = device->index;
+      slot->bEndpointAddress = transfer->bEndpointAddress;
+      slot->length = length;
+      memcpy(slot->data, transfer->data_buffer, length);
+      usbHost->reportRing.commit();
+    } else {
+      device->overflowCount++;
+    }
+    device->reportCount++;
+
+    // エンドポイントごとの受信間隔を記録
+    if (endpoint_data->reportCount > 0) {
+      uint32_t gapUs = (uint32_t)(startUs - endpoint_data->lastReportUs);
+      if (gapUs < endpoint_data->minGapUs) {
+        endpoint_data->minGapUs = gapUs;
+      }
+      if (gapUs > endpoint_data->maxGapUs) {
+        endpoint_data->maxGapUs = gapUs;
       }
-      buffer_str += String(transfer->data_buffer[i], HEX) + " ";
     }
-    buffer_str.trim();
-    Serial.printf("USB受信データ: EP=0x%x Class=0x%x SubClass=0x%x Protocol=0x%x Data=[%s]\n",
-           transfer->bEndpointAddress,
-           endpoint_data->bInterfaceClass,
-           endpoint_data->bInterfaceSubClass,
-           endpoint_data->bInterfaceProtocol,
-           buffer_str.c_str());
-  }
-  #endif
-
-  if (endpoint_data->bInterfaceClass == USB_CLASS_HID) {
-    // HIDデバイス検出をデバッグ表示
-    #if DEBUG_OUTPUT
-    Serial.printf("HIDデバイス入力: SubClass=0x%x Protocol=0x%x\n", 
-             endpoint_data->bInterfaceSubClass, 
-             endpoint_data->bInterfaceProtocol);
-    #endif
-
-    if (endpoint_data->bInterfaceSubClass == HID_SUBCLASS_BOOT) {
-      if (endpoint_data->bInterfaceProtocol == HID_ITF_PROTOCOL_KEYBOARD) {
-        #if DEBUG_OUTPUT
-        Serial.println("キーボード入力検出！");
-        #endif
-        
-        static hid_keyboard_report_t last_report = {};
-
-        // HID_KEY_NUM_LOCKの特別処理
-        if (transfer->actual_num_bytes > 2 && transfer->data_buffer[2] == HID_KEY_NUM_LOCK) {
-          #if DEBUG_OUTPUT
-          Serial.println("NumLock検出");
-          #endif
-        } 
-        else {
-          // キーボードレポートの作成
-          hid_keyboard_report_t report = {};
-          
-          // データが少なくとも8バイトあることを確認
-          if (transfer->actual_num_bytes >= 8) {
-            report.modifier = transfer->data_buffer[0];
-            report.reserved = transfer->data_buffer[1];
-            report.keycode[0] = transfer->data_buffer[2];
-            report.keycode[1] = transfer->data_buffer[3];
-            report.keycode[2] = transfer->data_buffer[4];
-            report.keycode[3] = transfer->data_buffer[5];
-            report.keycode[4] = transfer->data_buffer[6];
-            report.keycode[5] = transfer->data_buffer[7];
-          } else {
-            // データが少ない場合は、利用可能なバイトだけコピー
-            report.modifier = transfer->data_buffer[0];
-            // 安全のため残りをゼロで初期化
-            for (int i = 1; i < transfer->actual_num_bytes; i++) {
-              ((uint8_t*)&report)[i] = transfer->data_buffer[i];
-            }
-          }
+    endpoint_data->lastReportUs = startUs;
+    endpoint_data->reportCount++;
+  }
 
-          // キーコードの表示
-          #if DEBUG_OUTPUT
-          Serial.printf("キーコード: [%02x %02x %02x %02x %02x %02x] modifier: %02x\n",
-                  report.keycode[0], report.keycode[1], report.keycode[2],
-                  report.keycode[3], report.keycode[4], report.keycode[5],
-                  report.modifier);
-          #endif
-
-          // キーボードイベント処理
-          usbHost->onKeyboard(report, last_report);
-
-          // シフトキーの状態を確認
-          bool shift = (report.modifier & KEYBOARD_MODIFIER_LEFTSHIFT) || 
-                      (report.modifier & KEYBOARD_MODIFIER_RIGHTSHIFT);
-          
-          // 各キーコードを処理
-          for (int i = 0; i < 6; i++) {
-            // 新しく押されたキーを検出（前回のレポートにないキー）
-            if (report.keycode[i] != 0 && !keyInReport(last_report, report.keycode[i])) {
-              uint8_t ascii = usbHost->getKeycodeToAscii(report.keycode[i], shift);
-              #if DEBUG_OUTPUT
-              Serial.printf("新しいキー: ASCII=0x%02x, keycode=0x%02x, shift=%d\n", 
-                      ascii, report.keycode[i], shift);
-              #endif
-              usbHost->onKeyboardKey(ascii, report.keycode[i], report.modifier);
-            }
-          }
+  // 完了したその場で同じ転送を再投入する
+  // ポーリング周期はホストスタックがエンドポイントのbIntervalに従って管理する
+  if (!device->isReady || transfer->status == USB_TRANSFER_STATUS_NO_DEVICE) {
+    // 切断・クローズ中は何もしない
+  } else if (endpoint_data->recovering) {
+    // 復旧待ちのエンドポイントの転送は、待ち時間が過ぎるまで止めておく
+    endpoint_data->parkedCount++;
+  } else if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+    endpoint_data->errorStreak = 0;
+    esp_err_t err = usbHost->_submitInterrupt(device, transfer);
+    if (err != ESP_OK) {
+      usbHost->taskStats.submitErrors++;
+      device->submitErrors++;
+      usbHost->_haltEndpoint(device, endpoint_data, transfer->bEndpointAddress, USB_TRANSFER_STATUS_ERROR);
+      endpoint_data->parkedCount++;
+    }
+  } else if (transfer->status != USB_TRANSFER_STATUS_CANCELED) {
+    // STALL・タイムアウト・CRC等: エンドポイントを止めて、待ってから投入し直す
+    usbHost->_haltEndpoint(device, endpoint_data, transfer->bEndpointAddress, transfer->status);
+    endpoint_data->parkedCount++;
+  }
 
-          // 最新のレポートを保存
-          memcpy(&last_report, &report, sizeof(last_report));
-        }
-      } else if (endpoint_data->bInterfaceProtocol == HID_ITF_PROTOCOL_MOUSE) {
-        #if DEBUG_OUTPUT
-        Serial.println("マウス入力検出");
-        #endif
-        
-        static uint8_t last_buttons = 0;
-        hid_mouse_report_t report = {};
-        
-        if (transfer->actual_num_bytes > 0) {
-          report.buttons = transfer->data_buffer[0]; // 0番目がボタン状態
-        }
-        
-        if (transfer->actual_num_bytes > 2) {
-          report.x = (int8_t)transfer->data_buffer[1]; // 1番目がX軸（符号付き8ビット）
-          report.y = (int8_t)transfer->data_buffer[2]; // 2番目がY軸（符号付き8ビット）
-        }
-        
-        // ホイール情報（存在する場合）
-        if (transfer->actual_num_bytes > 3) {
-          report.wheel = (int8_t)transfer->data_buffer[3]; // ホイールは符号付き
+  // コールバック処理時間を記録（USBタスクを占有した時間）
+  uint32_t elapsedUs = (uint32_t)(esp_timer_get_time() - startUs);
+  usbHost->taskStats.callbackCount++;
+  usbHost->taskStats.lastCallbackUs = elapsedUs;
+  usbHost->taskStats.totalCallbackUs += elapsedUs;
+  if (elapsedUs > usbHost->taskStats.maxCallbackUs) {
+    usbHost->taskStats.maxCallbackUs = elapsedUs;
+  }
+}
+
+void EspUsbHost::processReports(void) {
+  usb_report_t *report;
+  while ((report = this->reportRing.peek()) != NULL) {
+    // 受信からコンシューマが取り出すまでの待ち時間
+    uint32_t latencyUs = (uint32_t)(esp_timer_get_time() - report->timestamp_us);
+    this->lastQueueLatencyUs = latencyUs;
+    if (latencyUs > this->maxQueueLatencyUs) {
+      this->maxQueueLatencyUs = latencyUs;
+    }
+
+    this->currentReportUs = report->timestamp_us;
+    if (report->length == 0) {
+      // デバイス切断: 押下中だったキーをすべて解放として通知し、枠を返す
+      _releaseDevice(&this->devices[report->deviceIndex]);
+    } else {
+      _processReport(*report);
+    }
+    this->reportRing.release();
+  }
+
+  // 切断通知を積めなかったデバイスは、それより前のレポートを処理し終えてから返す
+  for (int i = 0; i < USB_HOST_MAX_DEVICES; i++) {
+    device_data_t *device = &this->devices[i];
+    if (device->goneLost.load(std::memory_order_acquire) && this->reportRing.peek() == NULL) {
+      device->goneLost.store(false, std::memory_order_relaxed);
+      _releaseDevice(device);
+    }
+  }
+}
+
+void EspUsbHost::_processReport(const usb_report_t &raw) {
+  EspUsbHost *usbHost = this;
+  device_data_t *device = &this->devices[raw.deviceIndex];
+  endpoint_data_t *endpoint_data = &device->endpoint_data_list[(raw.bEndpointAddress & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK)];
+
+  // 受信記録（整形はイベントログの吐き出し側で行う）
+  EVENT_LOG_DATA(EVT_REPORT, raw.deviceIndex, raw.bEndpointAddress, raw.length, raw.data, raw.length);
+
+  // 列挙時に選んだデコーダへ直接渡す
+  if (endpoint_data->decoder != NULL) {
+    endpoint_data->decodedCount++;
+    endpoint_data->decoder(usbHost, device, endpoint_data, raw);
+  }
+
+  // カスタムイベントハンドラを呼び出し
+  usbHost->onReceive(raw);
+}
+
+void EspUsbHost::_decodeKeyboardReport(EspUsbHost *usbHost, device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw) {
+  // キーボードは状態を送るだけなので、前回と同じレポートは読み飛ばす
+  if (raw.length == endpoint_data->lastReportLength && memcmp(raw.data, endpoint_data->lastReport, raw.length) == 0) {
+    endpoint_data->unchangedCount++;
+    return;
+  }
+
+  // ベンダー独自形式は利用側のデコーダで読み、標準のデコードには回さない（同じ押下を別の解釈で二重に通知しない）
+  hid_key_bitmap_t vendor_keys;
+  usb_report_view_t report = {raw.data, raw.length, raw.deviceIndex, raw.bEndpointAddress, endpoint_data->bInterfaceNumber, raw.timestamp_us};
+  usb_report_view_t last_report = {endpoint_data->lastReport, endpoint_data->lastReportLength, raw.deviceIndex, raw.bEndpointAddress, endpoint_data->bInterfaceNumber, 0};
+  vendor_keys.clear();
+
+  const hid_report_map_t *map = usbHost->getReportMap(device, endpoint_data->bInterfaceNumber);
+  if (usbHost->onDecodeVendorKeyboard(report, last_report, vendor_keys)) {
+    usbHost->_notifyBootKeyboard(endpoint_data, raw);
+    usbHost->_setInterfaceKeys(device, endpoint_data, vendor_keys);
+  } else if (map == NULL) {
+    // ディスクリプタ未取得の間はブートプロトコルの固定配置で読む
+    usbHost->_decodeBootKeyboard(device, endpoint_data, raw);
+  } else {
+    const uint8_t *payload;
+    uint16_t payload_len;
+    const hid_report_info_t *info = map->match(HID_REPORT_TYPE_INPUT, raw.data, raw.length, &payload, &payload_len);
+    if (info == NULL || info->kind == HID_REPORT_KIND_KEYBOARD) {
+      // 表に合わないレポート（ベンダー独自形式など）も含め、キーボードのレポートは生バイトでも通知する
+      usbHost->_notifyBootKeyboard(endpoint_data, raw);
+    }
+    if (info != NULL) {
+      usbHost->_routeReport(device, *map, endpoint_data, *info, payload, payload_len, raw.timestamp_us);
+    }
+  }
+
+  memcpy(endpoint_data->lastReport, raw.data, raw.length);
+  endpoint_data->lastReportLength = raw.length;
+}
+
+void EspUsbHost::_decodeMouseReport(EspUsbHost *usbHost, device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw) {
+  const hid_report_map_t *map = usbHost->getReportMap(device, endpoint_data->bInterfaceNumber);
+
+  if (map != NULL) {
+    // 同じエンドポイントにConsumer Control等のレポートIDが混在していても種別で振り分ける
+    const uint8_t *payload;
+    uint16_t payload_len;
+    const hid_report_info_t *info = map->match(HID_REPORT_TYPE_INPUT, raw.data, raw.length, &payload, &payload_len);
+    if (info != NULL) {
+      usbHost->_routeReport(device, *map, endpoint_data, *info, payload, payload_len, raw.timestamp_us);
+    }
+    return;
+  }
+
+  // ディスクリプタ未取得の間はブートプロトコルの固定配置で読む
+  usb_mouse_report_t report = {};
+  report.buttons = raw.data[0]; // 0番目がボタン状態
+  
+  if (raw.length > 2) {
+    report.x = (int8_t)raw.data[1]; // 1番目がX軸（符号付き8ビット）
+    report.y = (int8_t)raw.data[2]; // 2番目がY軸（符号付き8ビット）
+  }
+  
+  // ホイール情報（存在する場合）
+  if (raw.length > 3) {
+    report.wheel = (int8_t)raw.data[3]; // ホイールは符号付き
+  }
+
+  usbHost->_dispatchMouse(endpoint_data, report);
+}
+
+void EspUsbHost::_decodeHidReport(EspUsbHost *usbHost, device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw) {
+  // ブート以外のHIDはレイアウト表がないと解釈できない
+  const hid_report_map_t *map = usbHost->getReportMap(device, endpoint_data->bInterfaceNumber);
+  if (map == NULL) {
+    return;
+  }
+
+  const uint8_t *payload;
+  uint16_t payload_len;
+  const hid_report_info_t *info = map->match(HID_REPORT_TYPE_INPUT, raw.data, raw.length, &payload, &payload_len);
+  if (info == NULL) {
+    return;
+  }
+
+  // マウスは相対値なので同じレポートでも毎回処理し、状態を送る種別だけ重複を読み飛ばす
+  if (info->kind != HID_REPORT_KIND_MOUSE) {
+    if (raw.length == endpoint_data->lastReportLength && memcmp(raw.data, endpoint_data->lastReport, raw.length) == 0) {
+      endpoint_data->unchangedCount++;
+      return;
+    }
+    memcpy(endpoint_data->lastReport, raw.data, raw.length);
+    endpoint_data->lastReportLength = raw.length;
+  }
+
+  usbHost->_routeReport(device, *map, endpoint_data, *info, payload, payload_len, raw.timestamp_us);
+}
+
+void EspUsbHost::_routeReport(device_data_t *device, const hid_report_map_t &map, endpoint_data_t *endpoint_data, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, int64_t timestamp_us) {
+  // レポートIDから引いた種別（列挙時に決定済み）で専用デコーダへ振り分ける
+  switch (info.kind) {
+    case HID_REPORT_KIND_KEYBOARD:
+      _decodeKeyboard(device, map, endpoint_data, info, payload, payload_len);
+      break;
+
+    case HID_REPORT_KIND_MOUSE:
+      {
+        usb_mouse_report_t report = {};
+        _decodeMouse(map, info, payload, payload_len, report);
+        _dispatchMouse(endpoint_data, report);
+      }
+      break;
+
+    case HID_REPORT_KIND_CONSUMER:
+      {
+        uint16_t usages[USB_HOST_MAX_CONTROL_USAGES];
+        uint8_t count = map.decodeUsages(info, HID_USAGE_PAGE_CONSUMER, payload, payload_len, usages, USB_HOST_MAX_CONTROL_USAGES);
+        _updateUsages(HID_USAGE_PAGE_CONSUMER, usages, count, endpoint_data->consumerUsages, endpoint_data->consumerCount);
+      }
+      break;
+
+    case HID_REPORT_KIND_SYSTEM:
+      {
+        uint16_t usages[USB_HOST_MAX_CONTROL_USAGES];
+        uint8_t count = map.decodeUsages(info, HID_USAGE_PAGE_DESKTOP, payload, payload_len, usages, USB_HOST_MAX_CONTROL_USAGES);
+        _updateUsages(HID_USAGE_PAGE_DESKTOP, usages, count, endpoint_data->systemUsages, endpoint_data->systemCount);
+      }
+      break;
+
+    case HID_REPORT_KIND_GAMEPAD:
+      _onDataGamepad(endpoint_data, map, info, payload, payload_len, timestamp_us);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static bool usageInList(const uint16_t *usages, uint8_t count, uint16_t usage) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (usages[i] == usage) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void EspUsbHost::_updateUsages(uint16_t usage_page, const uint16_t *usages, uint8_t count, uint16_t *last, uint8_t &last_count) {
+  // 前回の一覧と比べ、消えたUsageは解放、増えたUsageは押下として通知する
+  for (uint8_t i = 0; i < last_count; i++) {
+    if (!usageInList(usages, count, last[i])) {
+      if (usage_page == HID_USAGE_PAGE_CONSUMER) {
+        onConsumerControl(last[i], false);
+      } else {
+        onSystemControl(last[i], false);
+      }
+    }
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    if (!usageInList(last, last_count, usages[i])) {
+      if (usage_page == HID_USAGE_PAGE_CONSUMER) {
+        onConsumerControl(usages[i], true);
+      } else {
+        onSystemControl(usages[i], true);
+      }
+    }
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    last[i] = usages[i];
+  }
+  last_count = count;
+}
+
+void EspUsbHost::_dispatchMouse(endpoint_data_t *endpoint_data, const usb_mouse_report_t &report) {
+  EVENT_LOG(EVT_MOUSE, report.buttons, report.x, report.y);
+
+  // マウスイベント処理
+  onMouse(report, endpoint_data->lastButtons);
+  
+  // ボタンイベント処理
+  if (report.buttons != endpoint_data->lastButtons) {
+    onMouseButtons(report, endpoint_data->lastButtons);
+    endpoint_data->lastButtons = report.buttons;
+  }
+  
+  // 移動イベント処理
+  if (report.x != 0 || report.y != 0 || report.wheel != 0 || report.pan != 0) {
+    onMouseMove(report);
+  }
+}
+
+void EspUsbHost::_resetDecodeState(device_data_t *device) {
+  for (int i = 0; i < 17; i++) {
+    endpoint_data_t *endpoint_data = &device->endpoint_data_list[i];
+    endpoint_data->lastReportLength = 0;
+    endpoint_data->lastButtons = 0;
+    // 押下中だったメディアキー等も解放として通知する
+    _updateUsages(HID_USAGE_PAGE_CONSUMER, NULL, 0, endpoint_data->consumerUsages, endpoint_data->consumerCount);
+    _updateUsages(HID_USAGE_PAGE_DESKTOP, NULL, 0, endpoint_data->systemUsages, endpoint_data->systemCount);
+    // ゲームパッドはボタンを離し軸を中央に戻した状態を通知する
+    if (endpoint_data->gamepadActive) {
+      usb_gamepad_state_t neutral = {};
+      neutral.hat = USB_GAMEPAD_HAT_CENTER;
+      neutral.timestamp_us = esp_timer_get_time();
+      onGamepad(neutral);
+      endpoint_data->gamepadActive = false;
+    }
+  }
+  for (int i = 0; i < USB_HOST_MAX_INTERFACES; i++) {
+    device->interfaceKeys[i].clear();
+  }
+  _updateKeyState();
+}
+
+void EspUsbHost::_releaseDevice(device_data_t *device) {
+  _resetDecodeState(device);
+  for (int i = 0; i < USB_HOST_MAX_INTERFACES; i++) {
+    device->reportMap[i].clear();
+  }
+  // ここから先はクライアントタスクが新しいデバイスに割り当てられる
+  device->releasing.store(false, std::memory_order_release);
+}
+
+const hid_report_map_t *EspUsbHost::getReportMap(const device_data_t *device, uint8_t bInterfaceNumber) const {
+  if (bInterfaceNumber >= USB_HOST_MAX_INTERFACES || !device->reportMap[bInterfaceNumber].isValid()) {
+    return NULL;
+  }
+  return &device->reportMap[bInterfaceNumber];
+}
+
+void EspUsbHost::_decodeMouse(const hid_report_map_t &map, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, usb_mouse_report_t &report) {
+  // レイアウト表をたどって各フィールドを取り出す（16ビット座標などブート以外の配置にも対応）
+  for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+    const hid_field_t &field = map.fields[f];
+    if (!(field.flags & HID_FIELD_VARIABLE)) {
+      continue;
+    }
+
+    for (uint8_t i = 0; i < field.count; i++) {
+      uint16_t usage = field.usage_min + i;
+      if (usage > field.usage_max) {
+        usage = field.usage_max;
+      }
+
+      if (field.usage_page == HID_USAGE_PAGE_BUTTON) {
+        if (usage >= 1 && usage <= 8 && hid_field_value(field, payload, payload_len, i)) {
+          report.buttons |= (1 << (usage - 1));
         }
-        
-        // マウスイベント処理
-        usbHost->onMouse(report, last_buttons);
-        
-        // ボタンイベント処理
-        if (report.buttons != last_buttons) {
-          usbHost->onMouseButtons(report, last_buttons);
-          last_buttons = report.buttons;
+      } else if (field.usage_page == HID_USAGE_PAGE_DESKTOP) {
+        if (usage == HID_USAGE_DESKTOP_X) {
+          report.x = hid_field_value(field, payload, payload_len, i);
+        } else if (usage == HID_USAGE_DESKTOP_Y) {
+          report.y = hid_field_value(field, payload, payload_len, i);
+        } else if (usage == HID_USAGE_DESKTOP_WHEEL) {
+          report.wheel = hid_field_value(field, payload, payload_len, i);
         }
-        
-        // 移動イベント処理
-        if (report.x != 0 || report.y != 0 || report.wheel != 0) {
-          usbHost->onMouseMove(report);
+      } else if (field.usage_page == HID_USAGE_PAGE_CONSUMER && usage == HID_USAGE_CONSUMER_AC_PAN) {
+        report.pan = hid_field_value(field, payload, payload_len, i);
+      }
+    }
+  }
+}
+
+// 論理範囲を-32767..32767へ線形に写す（範囲が不正なら0）
+static int16_t normalizeAxis(int32_t value, int32_t logical_min, int32_t logical_max) {
+  if (logical_max <= logical_min) {
+    return 0;
+  }
+  if (value < logical_min) {
+    value = logical_min;
+  } else if (value > logical_max) {
+    value = logical_max;
+  }
+  int64_t scaled = ((int64_t)(value - logical_min) * 65534) / ((int64_t)logical_max - logical_min) - 32767;
+  return (int16_t)scaled;
+}
+
+void EspUsbHost::_onDataGamepad(endpoint_data_t *endpoint_data, const hid_report_map_t &map, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, int64_t timestamp_us) {
+  usb_gamepad_state_t state = {};
+  state.hat = USB_GAMEPAD_HAT_CENTER;
+  state.timestamp_us = timestamp_us;
+
+  // 軸とハットはGeneric DesktopページのVariableフィールドから読む
+  for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+    const hid_field_t &field = map.fields[f];
+    if (field.usage_page != HID_USAGE_PAGE_DESKTOP || !(field.flags & HID_FIELD_VARIABLE)) {
+      continue;
+    }
+
+    for (uint8_t i = 0; i < field.count; i++) {
+      uint16_t usage = field.usage_min + i;
+      if (usage > field.usage_max) {
+        usage = field.usage_max;
+      }
+      int32_t value = hid_field_value(field, payload, payload_len, i);
+
+      if (usage >= HID_USAGE_DESKTOP_X && usage <= HID_USAGE_DESKTOP_RZ) {
+        state.axes[usage - HID_USAGE_DESKTOP_X] = normalizeAxis(value, field.logical_min, field.logical_max);
+      } else if (usage == HID_USAGE_DESKTOP_HAT_SWITCH) {
+        // 論理範囲外はNull State（中立）、4方向のハットも8方向の位置へ揃える
+        if (value >= field.logical_min && value <= field.logical_max) {
+          state.hat = (uint8_t)(((value - field.logical_min) * 8) / (field.logical_max - field.logical_min + 1));
         }
       }
     }
   }
 
-  // カスタムイベントハンドラを呼び出し
-  usbHost->onReceive(transfer);
+  // ボタンはビット形式・配列形式のどちらでも押下中のUsageとして集める
+  uint16_t usages[32];
+  uint8_t count = map.decodeUsages(info, HID_USAGE_PAGE_BUTTON, payload, payload_len, usages, 32);
+  for (uint8_t i = 0; i < count; i++) {
+    if (usages[i] >= 1 && usages[i] <= 32) {
+      state.buttons |= (1UL << (usages[i] - 1));
+    }
+  }
+
+  EVENT_LOG(EVT_GAMEPAD, state.buttons, state.hat, (int32_t)state.axes[0]);
+  endpoint_data->gamepadActive = true;
+  onGamepad(state);
+}
+
+void EspUsbHost::_notifyBootKeyboard(endpoint_data_t *endpoint_data, const usb_report_t &raw) {
+  // ブートキーボードは従来どおりレポートの生バイトでも通知する（リングのスロットをそのまま指す）
+  if (endpoint_data->decoderType != USB_DECODER_KEYBOARD) {
+    return;
+  }
+
+  usb_report_view_t report = {raw.data, raw.length, raw.deviceIndex, raw.bEndpointAddress, endpoint_data->bInterfaceNumber, raw.timestamp_us};
+
+  EVENT_LOG_DATA(EVT_BOOT_KEYBOARD, report[0], 0, 0, raw.data, raw.length);
+
+  // 前回のレポートはこのエンドポイントの受信履歴を指す
+  usb_report_view_t last_report = {endpoint_data->lastReport, endpoint_data->lastReportLength, raw.deviceIndex, raw.bEndpointAddress, endpoint_data->bInterfaceNumber, 0};
+
+  onKeyboardReport(report, last_report);
+}
+
+void EspUsbHost::_decodeKeyboard(device_data_t *device, const hid_report_map_t &map, endpoint_data_t *endpoint_data, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len) {
+  // ディスクリプタのKeyboardページのフィールドから押下中のキーを集める（NKROビットマップも含む）
+  // Consumer/System Controlは別レポートIDとして振り分け済みなので、修飾キー0xE0-0xE7と衝突しない
+  hid_key_bitmap_t keys;
+  if (map.decodeKeys(info, payload, payload_len, keys)) {
+    _setInterfaceKeys(device, endpoint_data, keys);
+  }
+}
+
+void EspUsbHost::_decodeBootKeyboard(device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw) {
+  _notifyBootKeyboard(endpoint_data, raw);
+
+  // ブートプロトコルの固定配置（modifier + reserved + 6キー）で読む
+  hid_key_bitmap_t keys;
+  keys.clear();
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    if (raw.data[0] & (1 << bit)) {
+      keys.set(HID_KEY_CONTROL_LEFT + bit);
+    }
+  }
+  for (uint8_t i = 2; i < raw.length && i < 8; i++) {
+    if (raw.data[i] > HID_KEY_NONE && raw.data[i] <= 0x03) {
+      // ロールオーバーエラー時は押下状態が不定なので前回の状態を維持する
+      return;
+    } else if (raw.data[i] != HID_KEY_NONE) {
+      keys.set(raw.data[i]);
+    }
+  }
+  _setInterfaceKeys(device, endpoint_data, keys);
+}
+
+void EspUsbHost::_setInterfaceKeys(device_data_t *device, endpoint_data_t *endpoint_data, const hid_key_bitmap_t &keys) {
+  if (endpoint_data->bInterfaceNumber >= USB_HOST_MAX_INTERFACES) {
+    return;
+  }
+
+  hid_key_bitmap_t &last_keys = device->interfaceKeys[endpoint_data->bInterfaceNumber];
+  for (int w = 0; w < 8; w++) {
+    device->keyPressCount += __builtin_popcount(keys.word[w] & ~last_keys.word[w]);
+  }
+  last_keys = keys;
+  _updateKeyState();
+}
+
+void EspUsbHost::_updateKeyState(void) {
+  // 全デバイス・全インターフェースのキー状態を1つに合成する（複数キーボードで1本のBLEレポートにする）
+  hid_key_bitmap_t keys;
+  keys.clear();
+  for (int d = 0; d < USB_HOST_MAX_DEVICES; d++) {
+    for (int i = 0; i < USB_HOST_MAX_INTERFACES; i++) {
+      for (int w = 0; w < 8; w++) {
+        keys.word[w] |= this->devices[d].interfaceKeys[i].word[w];
+      }
+    }
+  }
+
+  // 前回との差分をワード単位のXORで求め、変化したビットだけをたどる
+  uint8_t modifier = keys.modifier();
+  bool shift = (modifier & (KEYBOARD_MODIFIER_LEFTSHIFT | KEYBOARD_MODIFIER_RIGHTSHIFT)) != 0;
+  for (int w = 0; w < 8; w++) {
+    uint32_t changed = keys.word[w] ^ this->keyState.word[w];
+    while (changed != 0) {
+      uint8_t bit = __builtin_ctz(changed);
+      changed &= changed - 1;
+
+      uint8_t keycode = (w << 5) | bit;
+      bool pressed = (keys.word[w] >> bit) & 1;
+      EVENT_LOG(EVT_KEY_CHANGE, keycode, pressed);
+      onKeyboardKeyChange(keycode, pressed, keys);
+
+      // 修飾キー以外の新規押下は従来のonKeyboardKey()にも通知する
+      if (pressed && keycode < HID_KEY_CONTROL_LEFT) {
+        uint8_t ascii = getKeycodeToAscii(keycode, shift);
+        onKeyboardKey(ascii, keycode, modifier);
+      }
+    }
+  }
+  this->keyState = keys;
 }
 
 // キーコードがレポートに含まれているかチェックするヘルパー関数
@@ -674,7 +1613,7 @@ bool keyInReport(const hid_keyboard_report_t &report, uint8_t keycode) {
   return false;
 }
 
-void EspUsbHost::onMouse(hid_mouse_report_t report, uint8_t last_buttons) {
+void EspUsbHost::onMouse(usb_mouse_report_t report, uint8_t last_buttons) {
   ESP_LOGD("EspUsbHost", "last_buttons=0x%02x(%c%c%c%c%c), buttons=0x%02x(%c%c%c%c%c), x=%d, y=%d, wheel=%d",
            last_buttons,
            (last_buttons & MOUSE_BUTTON_LEFT) ? 'L' : ' ',
@@ -688,12 +1627,12 @@ void EspUsbHost::onMouse(hid_mouse_report_t report, uint8_t last_buttons) {
            (report.buttons & MOUSE_BUTTON_MIDDLE) ? 'M' : ' ',
            (report.buttons & MOUSE_BUTTON_BACKWARD) ? 'B' : ' ',
            (report.buttons & MOUSE_BUTTON_FORWARD) ? 'F' : ' ',
-           report.x,
-           report.y,
-           report.wheel);
+           (int)report.x,
+           (int)report.y,
+           (int)report.wheel);
 }
 
-void EspUsbHost::onMouseButtons(hid_mouse_report_t report, uint8_t last_buttons) {
+void EspUsbHost::onMouseButtons(usb_mouse_report_t report, uint8_t last_buttons) {
   ESP_LOGD("EspUsbHost", "last_buttons=0x%02x(%c%c%c%c%c), buttons=0x%02x(%c%c%c%c%c), x=%d, y=%d, wheel=%d",
            last_buttons,
            (last_buttons & MOUSE_BUTTON_LEFT) ? 'L' : ' ',
@@ -707,9 +1646,9 @@ void EspUsbHost::onMouseButtons(hid_mouse_report_t report, uint8_t last_buttons)
            (report.buttons & MOUSE_BUTTON_MIDDLE) ? 'M' : ' ',
            (report.buttons & MOUSE_BUTTON_BACKWARD) ? 'B' : ' ',
            (report.buttons & MOUSE_BUTTON_FORWARD) ? 'F' : ' ',
-           report.x,
-           report.y,
-           report.wheel);
+           (int)report.x,
+           (int)report.y,
+           (int)report.wheel);
 
   // LEFT
   if (!(last_buttons & MOUSE_BUTTON_LEFT) && (report.buttons & MOUSE_BUTTON_LEFT)) {
@@ -752,7 +1691,7 @@ void EspUsbHost::onMouseButtons(hid_mouse_report_t report, uint8_t last_buttons)
   }
 }
 
-void EspUsbHost::onMouseMove(hid_mouse_report_t report) {
+void EspUsbHost::onMouseMove(usb_mouse_report_t report) {
   ESP_LOGD("EspUsbHost", "buttons=0x%02x(%c%c%c%c%c), x=%d, y=%d, wheel=%d",
            report.buttons,
            (report.buttons & MOUSE_BUTTON_LEFT) ? 'L' : ' ',
@@ -760,9 +1699,18 @@ void EspUsbHost::onMouseMove(hid_mouse_report_t report) {
            (report.buttons & MOUSE_BUTTON_MIDDLE) ? 'M' : ' ',
            (report.buttons & MOUSE_BUTTON_BACKWARD) ? 'B' : ' ',
            (report.buttons & MOUSE_BUTTON_FORWARD) ? 'F' : ' ',
-           report.x,
-           report.y,
-           report.wheel);
+           (int)report.x,
+           (int)report.y,
+           (int)report.wheel);
+}
+
+void EspUsbHost::onKeyboardReport(const usb_report_view_t &report, const usb_report_view_t &last_report) {
+  // onKeyboard()だけをオーバーライドしている利用側のため、ブート形式の構造体へ詰め直して呼ぶ
+  hid_keyboard_report_t legacy_report = {};
+  hid_keyboard_report_t legacy_last_report = {};
+  memcpy(&legacy_report, report.data, (report.length < sizeof(legacy_report)) ? report.length : sizeof(legacy_report));
+  memcpy(&legacy_last_report, last_report.data, (last_report.length < sizeof(legacy_last_report)) ? last_report.length : sizeof(legacy_last_report));
+  onKeyboard(legacy_report, legacy_last_report);
 }
 
 void EspUsbHost::onKeyboard(hid_keyboard_report_t report, hid_keyboard_report_t last_report) {
@@ -791,6 +1739,11 @@ uint8_t EspUsbHost::getKeycodeToAscii(uint8_t keycode, uint8_t shift) {
     shift = 1;
   }
 
+  // 変換表はUsage 0x00-0x7Fのみ（NKROで届く0x80以上は変換しない）
+  if (keycode >= 128) {
+    return 0;
+  }
+
   if (hidLocal == HID_LOCAL_Japan_Katakana) {
     // Japan
     return keyboard_conv_table_ja[keycode][shift];
@@ -816,43 +1769,102 @@ void EspUsbHost::onKeyboardKey(uint8_t ascii, uint8_t keycode, uint8_t modifier)
   }
 }
 
+void EspUsbHost::onKeyboardKeyChange(uint8_t keycode, bool pressed, const hid_key_bitmap_t &keys) {
+  ESP_LOGD("EspUsbHost", "Keyboard keycode=0x%02x %s, modifier=0x%02x", keycode, pressed ? "press" : "release", keys.modifier());
+}
+
 void EspUsbHost::setHIDLocal(hid_local_enum_t code) {
   hidLocal = code;
 }
 
 esp_err_t EspUsbHost::submitControl(const uint8_t bmRequestType, const uint8_t bDescriptorIndex, const uint8_t bDescriptorType, const uint16_t wInterfaceNumber, const uint16_t wDescriptorLength) {
+  // GET_DESCRIPTOR(0x06)
+  return submitControlRequest(this->_configDevice, bmRequestType, 0x06, (bDescriptorType << 8) | bDescriptorIndex, wInterfaceNumber, wDescriptorLength);
+}
+
+esp_err_t EspUsbHost::submitControlRequest(device_data_t *device, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, const uint8_t *data) {
   usb_transfer_t *transfer;
-  usb_host_transfer_alloc(wDescriptorLength + 8 + 1, 0, &transfer);
+  esp_err_t err = usb_host_transfer_alloc(wLength + 8 + 1, 0, &transfer);
+  if (err != ESP_OK) {
+    ESP_LOGI("EspUsbHost", "usb_host_transfer_alloc() err=%x", err);
+    return err;
+  }
 
-  transfer->num_bytes = wDescriptorLength + 8;
+  transfer->num_bytes = wLength + 8;
   transfer->data_buffer[0] = bmRequestType;
-  transfer->data_buffer[1] = 0x06;
-  transfer->data_buffer[2] = bDescriptorIndex;
-  transfer->data_buffer[3] = bDescriptorType;
-  transfer->data_buffer[4] = wInterfaceNumber & 0xff;
-  transfer->data_buffer[5] = wInterfaceNumber >> 8;
-  transfer->data_buffer[6] = wDescriptorLength & 0xff;
-  transfer->data_buffer[7] = wDescriptorLength >> 8;
-
-  transfer->device_handle = deviceHandle;
+  transfer->data_buffer[1] = bRequest;
+  transfer->data_buffer[2] = wValue & 0xff;
+  transfer->data_buffer[3] = wValue >> 8;
+  transfer->data_buffer[4] = wIndex & 0xff;
+  transfer->data_buffer[5] = wIndex >> 8;
+  transfer->data_buffer[6] = wLength & 0xff;
+  transfer->data_buffer[7] = wLength >> 8;
+  if (!(bmRequestType & USB_B_ENDPOINT_ADDRESS_EP_DIR_MASK) && data != NULL) {
+    memcpy(&transfer->data_buffer[8], data, wLength);
+  }
+
+  transfer->device_handle = device->deviceHandle;
   transfer->bEndpointAddress = 0x00;
   transfer->callback = _onReceiveControl;
-  transfer->context = this;
+  transfer->context = device;
 
-  //submitControl(0x81, 0x00, 0x22, 0x0000, 136);
-  if (bmRequestType == 0x81 && bDescriptorIndex == 0x00 && bDescriptorType == 0x22) {
-    _printPcapText("GET DESCRIPTOR Request HID Report", 0x0028, 0x00, 0x80, 0x02, 8, 0, transfer->data_buffer);
-  }
+#if USB_CAPTURE_ENABLED
+  usbCapture.controlSubmit(device->address, (uintptr_t)transfer, transfer->data_buffer);
+#endif
 
-  esp_err_t err = usb_host_transfer_submit_control(clientHandle, transfer);
+  err = usb_host_transfer_submit_control(clientHandle, transfer);
   if (err != ESP_OK) {
-    ESP_LOGI("EspUsbHost", "usb_host_transfer_submit_control() err=%x", err);
+    ESP_LOGI("EspUsbHost", "usb_host_transfer_submit_control() err=%x bRequest=0x%x", err, bRequest);
+    device->controlErrors++;
+    usb_host_transfer_free(transfer);
   }
   return err;
 }
 
+esp_err_t EspUsbHost::hidSetIdle(device_data_t *device, uint8_t bInterfaceNumber, uint8_t duration, uint8_t reportId) {
+  // durationは4ms単位（0なら変化があったときだけ送る）
+  return submitControlRequest(device, 0x21, HID_REQ_CONTROL_SET_IDLE, (duration << 8) | reportId, bInterfaceNumber, 0);
+}
+
+esp_err_t EspUsbHost::hidSetProtocol(device_data_t *device, uint8_t bInterfaceNumber, uint8_t protocol) {
+  return submitControlRequest(device, 0x21, HID_REQ_CONTROL_SET_PROTOCOL, protocol, bInterfaceNumber, 0);
+}
+
+esp_err_t EspUsbHost::hidSetReport(device_data_t *device, uint8_t bInterfaceNumber, uint8_t reportType, uint8_t reportId, const uint8_t *data, uint16_t length) {
+  return submitControlRequest(device, 0x21, HID_REQ_CONTROL_SET_REPORT, (reportType << 8) | reportId, bInterfaceNumber, length, data);
+}
+
+void EspUsbHost::_onControlComplete(device_data_t *device, usb_transfer_t *transfer) {
+  const uint8_t *setup = transfer->data_buffer;
+  if (transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
+    device->controlErrors++;
+  }
+
+  // エンドポイントのCLEAR_FEATURE(ENDPOINT_HALT)が終われば、転送の投入し直しを許可する
+  if (setup[0] == 0x02 && setup[1] == 0x01) {
+    device->endpoint_data_list[setup[4] & USB_B_ENDPOINT_ADDRESS_EP_NUM_MASK].clearPending = false;
+    _resumeEndpoints();
+  }
+
+  // LEDの出力レポートは全インターフェース分が完了したら、その間に変わった最新値を送る
+  if (setup[1] == HID_REQ_CONTROL_SET_REPORT && setup[3] == HID_REPORT_TYPE_OUTPUT && device->ledsInFlight > 0) {
+    device->ledsInFlight--;
+    if (device->ledsInFlight == 0) {
+      _flushLeds();
+    }
+    return;
+  }
+
+  ESP_LOGI("EspUsbHost", "control device=%d bmRequestType=0x%02x bRequest=0x%02x wValue=0x%04x wIndex=%d status=%d",
+           device->index, setup[0], setup[1], setup[2] | (setup[3] << 8), setup[4] | (setup[5] << 8), transfer->status);
+}
+
 void EspUsbHost::_onReceiveControl(usb_transfer_t *transfer) {
-  _printPcapText("GET DESCRIPTOR Response HID Report", 0x0008, 0x01, 0x80, 0x02, transfer->actual_num_bytes - 8, 0x03, &transfer->data_buffer[8]);
+#if USB_CAPTURE_ENABLED
+  usbCapture.controlComplete(((device_data_t *)transfer->context)->address, (uintptr_t)transfer, transfer->data_buffer[0] & 0x80,
+                             UsbCapture::transferStatus(transfer->status), &transfer->data_buffer[8],
+                             (transfer->actual_num_bytes > 8) ? transfer->actual_num_bytes - 8 : 0);
+#endif
 
   ESP_LOGV("EspUsbHost", "_onReceiveControl()\n"
                          "# data_buffer_size   = %d\n"
@@ -870,6 +1882,14 @@ void EspUsbHost::_onReceiveControl(usb_transfer_t *transfer) {
            transfer->timeout_ms,
            transfer->num_isoc_packets);
 
+  // レポートディスクリプタのGET_DESCRIPTOR以外（クラスリクエスト等）は結果を記録するだけ
+  device_data_t *device = (device_data_t *)transfer->context;
+  if (transfer->data_buffer[1] != 0x06 || transfer->data_buffer[3] != 0x22) {
+    device->usbHost->_onControlComplete(device, transfer);
+    usb_host_transfer_free(transfer);
+    return;
+  }
+
 #if (ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO)
   printf("=====================================================\n");
   uint16_t page = 0;
@@ -1372,5 +2392,31 @@ void EspUsbHost::_onReceiveControl(usb_transfer_t *transfer) {
   printf("-----------------------------------------------------\n");
 #endif
 
+  // レポートディスクリプタをフィールドレイアウト表に変換して保存する
+  uint8_t bInterfaceNumber = transfer->data_buffer[4];
+  if (transfer->status != USB_TRANSFER_STATUS_COMPLETED || transfer->actual_num_bytes <= 8) {
+    ESP_LOGI("EspUsbHost", "HID report descriptor err status=%d, bInterfaceNumber=%d", transfer->status, bInterfaceNumber);
+  } else if (bInterfaceNumber >= USB_HOST_MAX_INTERFACES) {
+    ESP_LOGI("EspUsbHost", "HID report descriptor skip bInterfaceNumber=%d", bInterfaceNumber);
+  } else {
+    // このインターフェースのIN転送は開始済みなので、表はparse()の最後で公開されるまでloop()から使われない
+    hid_report_map_t *map = &device->reportMap[bInterfaceNumber];
+    if (map->isValid()) {
+      ESP_LOGI("EspUsbHost", "HID report map already published bInterfaceNumber=%d", bInterfaceNumber);
+    } else if (!map->parse(&transfer->data_buffer[8], transfer->actual_num_bytes - 8)) {
+      ESP_LOGI("EspUsbHost", "HID report descriptor parse incomplete bInterfaceNumber=%d", bInterfaceNumber);
+    }
+    ESP_LOGI("EspUsbHost", "HID report map device=%d bInterfaceNumber=%d reports=%d fields=%d", device->index, bInterfaceNumber, map->report_count, map->field_count);
+    map->print();
+
+    // 次回の接続で制御転送を省けるよう、解析できたディスクリプタを覚えておく
+    if (map->isValid()) {
+      device->usbHost->descriptorCache.storeReport(device->cacheKey, bInterfaceNumber, &transfer->data_buffer[8], transfer->actual_num_bytes - 8);
+    }
+  }
+
+  // 後から接続したキーボードにも現在のLED状態を反映する
+  device->usbHost->_flushLeds();
+
   usb_host_transfer_free(transfer);
 }
\ No newline at end of file
@@ -2,25 +2,140 @@
 #define __EspUsbHost_H__
 
 #include <Arduino.h>
+#include <esp_timer.h>
 #include <usb/usb_host.h>
 #include <class/hid/hid.h>
 #include <rom/usb/usb_common.h>
+#include "SpscRing.h"
+#include "HidReportParser.h"
+#include "UsbDescriptorCache.h"
+
+// USBホストタスクの設定（build_flagsで上書き可能）
+#ifndef USB_HOST_TASK_CORE
+#define USB_HOST_TASK_CORE 0          // USBホストタスクを固定するコア
+#endif
+#ifndef USB_HOST_TASK_PRIORITY
+#define USB_HOST_TASK_PRIORITY 5      // USBホストタスクの優先度（loop()は1）
+#endif
+#ifndef USB_HOST_TASK_STACK_SIZE
+#define USB_HOST_TASK_STACK_SIZE 4096 // USBホストタスクのスタックサイズ
+#endif
+#ifndef USB_HOST_STRING_SIZE
+#define USB_HOST_STRING_SIZE 64       // 製造元・製品名・シリアル番号のUTF-8バッファ長（終端込み、超えた分は文字単位で切り捨て）
+#endif
+
+// 受信レポートリングの設定
+#ifndef USB_REPORT_RING_SIZE
+#define USB_REPORT_RING_SIZE 32       // リングのスロット数（2のべき乗）
+#endif
+#define USB_REPORT_MAX_SIZE 64        // 1レポートの最大バイト数（FSインタラプト転送の上限）
+
+// INエンドポイントごとに常時投入しておく転送数（2でダブルバッファ）
+#ifndef USB_HOST_IN_TRANSFER_DEPTH
+#define USB_HOST_IN_TRANSFER_DEPTH 2
+#endif
+#define USB_HOST_MAX_TRANSFERS 16
+
+// レポートディスクリプタの解析結果を保持するインターフェース数（bInterfaceNumberで引く）
+#ifndef USB_HOST_MAX_INTERFACES
+#define USB_HOST_MAX_INTERFACES 8
+#endif
+
+// 同時に扱うデバイス数（ハブ経由で複数接続する場合）
+#ifndef USB_HOST_MAX_DEVICES
+#define USB_HOST_MAX_DEVICES 4
+#endif
+
+// Consumer Control / System Controlで同時に押下を追跡するUsage数（エンドポイントごと）
+#ifndef USB_HOST_MAX_CONTROL_USAGES
+#define USB_HOST_MAX_CONTROL_USAGES 4
+#endif
+
+// 列挙時に送るHIDクラスリクエスト
+#ifndef USB_HOST_HID_SET_IDLE
+#define USB_HOST_HID_SET_IDLE 1       // 1ならSET_IDLE(0)を送り、変化のないレポートの再送を止める
+#endif
+#define USB_HOST_HID_PROTOCOL_KEEP 0xff
+#ifndef USB_HOST_HID_PROTOCOL
+#define USB_HOST_HID_PROTOCOL HID_PROTOCOL_REPORT  // ブートサブクラスのインターフェースに設定するプロトコル（USB_HOST_HID_PROTOCOL_KEEPなら送らない）
+#endif
+
+// 転送エラー（STALL・タイムアウト等）からの復旧待ち時間（失敗が続くたびに倍、上限あり）
+#ifndef USB_HOST_RETRY_BASE_US
+#define USB_HOST_RETRY_BASE_US 1000
+#endif
+#ifndef USB_HOST_RETRY_MAX_US
+#define USB_HOST_RETRY_MAX_US 100000
+#endif
+
+// 受信コールバックからコンシューマへ渡す生レポート
+struct usb_report_t {
+  int64_t timestamp_us;      // 受信コールバック時刻（esp_timer）
+  uint8_t deviceIndex;       // devices[]のインデックス
+  uint8_t bEndpointAddress;
+  uint8_t length;
+  uint8_t data[USB_REPORT_MAX_SIZE];
+};
+
+// レポートのバイト列を指すだけのビュー（リングのスロットや前回レポートをコピーせずに各段へ渡す）
+// ビューの寿命はコールバック内のみ（processReports()がスロットを返却するまで）
+struct usb_report_view_t {
+  const uint8_t *data;       // レポート先頭（レポートIDを使うデバイスではIDを含む）
+  uint8_t length;
+  uint8_t deviceIndex;
+  uint8_t bEndpointAddress;
+  uint8_t bInterfaceNumber;
+  int64_t timestamp_us;      // 受信コールバック時刻（前回レポートでは0）
+
+  // 範囲外は0を返す（短いレポートをブート形式の固定位置で読む場合も安全）
+  uint8_t operator[](uint8_t index) const { return (index < length) ? data[index] : 0; }
+};
+
+// レポートディスクリプタの論理範囲から正規化したゲームパッドの状態
+#define USB_GAMEPAD_AXES 6            // X, Y, Z, Rx, Ry, Rz
+#define USB_GAMEPAD_HAT_CENTER 8      // ハットスイッチの中立
+struct usb_gamepad_state_t {
+  int16_t axes[USB_GAMEPAD_AXES];     // -32767..32767（論理範囲の中央が0、ない軸は0）
+  uint8_t hat;                        // 0=上から時計回りに45度ずつ、USB_GAMEPAD_HAT_CENTER=中立
+  uint32_t buttons;                   // Buttonページ Usage 1-32（ビットn-1）
+  int64_t timestamp_us;               // 元レポートの受信時刻（転送完了から送信までの遅延計測用）
+};
+
+// マウスの入力（16ビット座標のマウスも丸めずにBLEマウスまで渡す）
+struct usb_mouse_report_t {
+  uint8_t buttons;                    // MOUSE_BUTTON_*
+  int32_t x;
+  int32_t y;
+  int32_t wheel;
+  int32_t pan;                        // 水平スクロール（AC Pan）
+};
 
 // キーコードがレポートに含まれているかチェックするヘルパー関数
 bool keyInReport(const hid_keyboard_report_t &report, uint8_t keycode);
 
+// エンドポイントに割り当てるデコーダの種類（列挙時にインターフェース情報から決定）
+enum usb_decoder_type_t {
+  USB_DECODER_NONE = 0,   // HID以外（onReceive()のみ）
+  USB_DECODER_KEYBOARD,   // ブートキーボード
+  USB_DECODER_MOUSE,      // ブートマウス
+  USB_DECODER_HID,        // その他のHID（レポートディスクリプタの表で判別）
+};
+
 class EspUsbHost {
 public:
-  bool isReady = false;
-  uint8_t interval;
-  unsigned long lastCheck;
+  bool isReady = false;  // いずれかのデバイスが受信可能
 
-  // デバイス識別情報を格納するフィールド
+  // デバイス識別情報を格納するフィールド（最後に接続したデバイス）
   uint16_t idVendor = 0;
   uint16_t idProduct = 0;
-  String manufacturer = "";
-  String productName = "";
-  String serialNumber = "";
+  // 列挙時にUTF-8へ一度だけ変換して保持する（ヒープは使わない、表示側は参照で共有する）
+  char manufacturer[USB_HOST_STRING_SIZE] = "";
+  char productName[USB_HOST_STRING_SIZE] = "";
+  char serialNumber[USB_HOST_STRING_SIZE] = "";
+
+  struct endpoint_data_t;
+  struct device_data_t;
+  typedef void (*report_decoder_t)(EspUsbHost *usbHost, device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw);
 
   struct endpoint_data_t {
     uint8_t bInterfaceNumber;
@@ -28,8 +143,89 @@ public:
     uint8_t bInterfaceSubClass;
     uint8_t bInterfaceProtocol;
     uint8_t bCountryCode;    
+    uint8_t bInterval;         // このエンドポイントのポーリング周期（ms）
+
+    // 受信間隔の計測（実際のポーリング周期の確認用）
+    int64_t lastReportUs;
+    uint32_t reportCount;
+    uint32_t minGapUs;
+    uint32_t maxGapUs;
+
+    // デコード状態（エンドポイントごとに独立、複合デバイスでも互いに干渉しない）
+    uint8_t decoderType;       // usb_decoder_type_t
+    report_decoder_t decoder;  // 受信レポートの処理関数（NULLならデコードしない）
+    uint8_t lastReport[USB_REPORT_MAX_SIZE];
+    uint8_t lastReportLength;
+    uint8_t lastButtons;
+    uint16_t consumerUsages[USB_HOST_MAX_CONTROL_USAGES];  // 押下中のConsumer Control Usage
+    uint8_t consumerCount;
+    uint16_t systemUsages[USB_HOST_MAX_CONTROL_USAGES];    // 押下中のSystem Control Usage
+    uint8_t systemCount;
+    bool gamepadActive;        // ゲームパッドの状態を通知済み（切断時に中立を通知する）
+    uint32_t decodedCount;     // デコーダに渡したレポート数
+    uint32_t unchangedCount;   // 前回と同一のため読み飛ばしたレポート数
+
+    // 転送エラーからの復旧（エンドポイントを止め、待ってから転送を投入し直す）
+    uint8_t transferCount;     // このエンドポイントに割り当てた転送数
+    uint8_t parkedCount;       // 復旧待ちで止めている転送数
+    bool recovering;
+    bool clearPending;         // CLEAR_FEATURE(ENDPOINT_HALT)の完了待ち
+    uint8_t errorStreak;       // 連続したエラー数（待ち時間の倍率）
+    int64_t errorUs;           // 最初のエラー時刻
+    int64_t resumeAtUs;        // 転送を投入し直す時刻
+    uint32_t stallCount;
+    uint32_t timeoutCount;
+    uint32_t errorCount;       // その他のエラー（CRC・オーバーフロー等）と再投入失敗
+    uint32_t recoveryCount;
+    uint32_t lastRecoveryUs;   // 最後の復旧にかかった時間
   };
-  endpoint_data_t endpoint_data_list[17];
+
+  // 接続中のデバイスごとの状態（転送・インターフェース・デコーダ・計測値）
+  struct device_data_t {
+    EspUsbHost *usbHost;
+    bool inUse;
+    bool isReady;
+    // 切断後、コンシューマが切断通知を処理し終えるまで枠を再利用しない
+    // （リングに残ったレポートが新しいデバイスの表やデコード状態を使わないように）
+    std::atomic<bool> releasing{false};
+    std::atomic<bool> goneLost{false};  // リング満杯で切断通知を積めなかった
+    uint8_t index;
+    uint8_t address;
+    usb_device_handle_t deviceHandle;
+    uint16_t idVendor;
+    uint16_t idProduct;
+
+    // ディスクリプタキャッシュのキー（列挙時に作成）と、既知のデバイスとして高速に列挙したか
+    usb_desc_cache_key_t cacheKey;
+    bool cacheHit;
+
+    usb_transfer_t *usbTransfer[USB_HOST_MAX_TRANSFERS];
+    uint8_t usbTransferSize;
+    uint8_t usbInterface[16];
+    uint8_t usbInterfaceSize;
+    endpoint_data_t endpoint_data_list[17];
+
+    // インターフェースごとのレポートレイアウト表（列挙時に_onReceiveControl()で作成）
+    hid_report_map_t reportMap[USB_HOST_MAX_INTERFACES];
+    // インターフェースごとのキー状態（全デバイス分を合成してkeyStateにする）
+    hid_key_bitmap_t interfaceKeys[USB_HOST_MAX_INTERFACES];
+
+    // デバイスごとの計測値
+    int64_t connectedUs;
+    uint32_t reportCount;     // 受信レポート数
+    uint32_t overflowCount;   // リング満杯で破棄したレポート数
+    uint32_t submitErrors;    // 転送の再投入エラー数
+    uint32_t keyPressCount;   // キー押下数
+    uint32_t controlErrors;   // 完了しなかった制御転送の数（SET_IDLE未対応のSTALL等を含む）
+
+    // キーボードLED（出力レポート）の送信状態
+    uint8_t ledsSent;         // 最後に送ったLED状態
+    uint8_t ledsInFlight;     // 完了待ちのSET_REPORT数（0になるまで次は送らない）
+  };
+  device_data_t devices[USB_HOST_MAX_DEVICES];
+
+  // 列挙中のデバイス（列挙はクライアントタスク内で1台ずつ行われる）
+  device_data_t *_configDevice = NULL;
   uint8_t _bInterfaceNumber;
   uint8_t _bInterfaceClass;
   uint8_t _bInterfaceSubClass;
@@ -38,42 +234,130 @@ public:
   esp_err_t claim_err;
 
   usb_host_client_handle_t clientHandle;
-  usb_device_handle_t deviceHandle;
   uint32_t eventFlags;
-  usb_transfer_t *usbTransfer[16];
-  uint8_t usbTransferSize;
-  uint8_t usbInterface[16];
-  uint8_t usbInterfaceSize;
 
   hid_local_enum_t hidLocal;
 
+  // 接続し直したデバイスのレポートディスクリプタ（RAM + NVS）
+  UsbDescriptorCache descriptorCache;
+
+  // 全デバイス・全インターフェースのキー状態を合成したもの（BLEへ送る状態）
+  hid_key_bitmap_t keyState = {};
+
+  // ホストから届いたキーボードLED状態（ブートキーボードの出力レポートと同じビット配置: Num/Caps/Scroll/Compose/Kana）
+  // 書き込みは任意のタスクから、USBキーボードへの送信はUSBクライアントタスクで行う
+  std::atomic<uint8_t> requestedLeds{0};
+
+  // 転送エラーからの復旧時刻にUSBクライアントタスクを起こすタイマ
+  esp_timer_handle_t retryTimer = NULL;
+  int64_t retryTimerAtUs = 0;  // タイマをかけた時刻（過ぎていれば未設定と同じ）
+
+  // USBホストタスク（beginTask()で起動した場合に使用）
+  TaskHandle_t libTaskHandle = NULL;
+  TaskHandle_t clientTaskHandle = NULL;
+
+  // 受信コールバックの処理時間統計（USB完了→イベント処理のレイテンシ計測用）
+  struct task_stats_t {
+    uint32_t callbackCount;
+    uint32_t lastCallbackUs;
+    uint32_t maxCallbackUs;
+    uint64_t totalCallbackUs;
+    uint32_t submitErrors;
+  };
+  task_stats_t taskStats = {};
+
+  // 受信コールバック（USBタスク）→ processReports()（コンシューマ）間のリング
+  SpscRing<usb_report_t, USB_REPORT_RING_SIZE> reportRing;
+  uint32_t lastQueueLatencyUs = 0;
+  uint32_t maxQueueLatencyUs = 0;
+  // processReports()で処理中のレポートの受信時刻（デコード中のコールバックから遅延計測に使う）
+  int64_t currentReportUs = 0;
+
   void begin(void);
+  void beginTask(BaseType_t core = USB_HOST_TASK_CORE, UBaseType_t priority = USB_HOST_TASK_PRIORITY);
   void task(void);
+  void processReports(void);
+  void printTaskStats(void);
+  // キーボードLED状態を接続中の全USBキーボードへ反映する（どのタスクからでも呼べる、連続した変更は最新値にまとめる）
+  void setKeyboardLeds(uint8_t leds);
+
+  static void _libTask(void *arg);
+  static void _clientTask(void *arg);
+  void _submitTransfers(device_data_t *device);
+  device_data_t *_allocDevice(uint8_t address);
+  device_data_t *_findDevice(usb_device_handle_t deviceHandle);
+  endpoint_data_t *getEndpointData(const usb_report_t &raw);
 
   static void _clientEventCallback(const usb_host_client_event_msg_t *eventMsg, void *arg);
   void _configCallback(const usb_config_desc_t *config_desc);
   void onConfig(const uint8_t bDescriptorType, const uint8_t *p);
-  static String getUsbDescString(const usb_str_desc_t *str_desc);
+  static size_t getUsbDescString(const usb_str_desc_t *str_desc, char *out, size_t size);
   static void _onReceive(usb_transfer_t *transfer);
+  void _processReport(const usb_report_t &raw);
+  const hid_report_map_t *getReportMap(const device_data_t *device, uint8_t bInterfaceNumber) const;
+  void _routeReport(device_data_t *device, const hid_report_map_t &map, endpoint_data_t *endpoint_data, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, int64_t timestamp_us);
+  void _decodeMouse(const hid_report_map_t &map, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, usb_mouse_report_t &report);
+  void _decodeKeyboard(device_data_t *device, const hid_report_map_t &map, endpoint_data_t *endpoint_data, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len);
+  void _decodeBootKeyboard(device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw);
+  void _notifyBootKeyboard(endpoint_data_t *endpoint_data, const usb_report_t &raw);
+  void _setInterfaceKeys(device_data_t *device, endpoint_data_t *endpoint_data, const hid_key_bitmap_t &keys);
+  void _updateUsages(uint16_t usage_page, const uint16_t *usages, uint8_t count, uint16_t *last, uint8_t &last_count);
+  void _dispatchMouse(endpoint_data_t *endpoint_data, const usb_mouse_report_t &report);
+  void _updateKeyState(void);
+  void _resetDecodeState(device_data_t *device);
+  void _releaseDevice(device_data_t *device);
+
+  static void _decodeKeyboardReport(EspUsbHost *usbHost, device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw);
+  static void _decodeMouseReport(EspUsbHost *usbHost, device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw);
+  static void _decodeHidReport(EspUsbHost *usbHost, device_data_t *device, endpoint_data_t *endpoint_data, const usb_report_t &raw);
 
-  static void _printPcapText(const char* title, uint16_t function, uint8_t direction, uint8_t endpoint, uint8_t type, uint8_t size, uint8_t stage, const uint8_t *data);
   esp_err_t submitControl(const uint8_t bmRequestType, const uint8_t bDescriptorIndex, const uint8_t bDescriptorType, const uint16_t wInterfaceNumber, const uint16_t wDescriptorLength);
+  // 任意の制御転送（OUT方向ならdataのwLengthバイトを送る、完了は_onReceiveControl()）
+  esp_err_t submitControlRequest(device_data_t *device, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, const uint8_t *data = NULL);
+  // HIDクラスリクエスト（インターフェース宛て）
+  esp_err_t hidSetIdle(device_data_t *device, uint8_t bInterfaceNumber, uint8_t duration, uint8_t reportId = 0);
+  esp_err_t hidSetProtocol(device_data_t *device, uint8_t bInterfaceNumber, uint8_t protocol);
+  esp_err_t hidSetReport(device_data_t *device, uint8_t bInterfaceNumber, uint8_t reportType, uint8_t reportId, const uint8_t *data, uint16_t length);
   static void _onReceiveControl(usb_transfer_t *transfer);
+  void _onControlComplete(device_data_t *device, usb_transfer_t *transfer);
+  void _flushLeds(void);
+  // インタラプトIN転送の投入（キャプチャ中はSubmitも記録する）
+  esp_err_t _submitInterrupt(device_data_t *device, usb_transfer_t *transfer);
+  void _haltEndpoint(device_data_t *device, endpoint_data_t *endpoint_data, uint8_t bEndpointAddress, usb_transfer_status_t status);
+  void _resumeEndpoints(void);
+  void _scheduleRetry(int64_t atUs, int64_t now);
+  static void _retryTimerCallback(void *arg);
+  uint8_t _sendLeds(device_data_t *device, uint8_t leds);
 
-  virtual void onReceive(const usb_transfer_t *transfer){};
+  virtual void onReceive(const usb_report_t &report){};
   virtual void onGone(const usb_host_client_event_msg_t *eventMsg){};
   // デバイス接続時のコールバック
   virtual void onDeviceConnected(){};
+  // ブートサブクラスのインターフェースに設定するプロトコル（HID_PROTOCOL_BOOT/HID_PROTOCOL_REPORT/USB_HOST_HID_PROTOCOL_KEEP）
+  virtual uint8_t onSelectHidProtocol(const device_data_t *device, uint8_t bInterfaceNumber, uint8_t bInterfaceProtocol) { return USB_HOST_HID_PROTOCOL; }
 
   virtual uint8_t getKeycodeToAscii(uint8_t keycode, uint8_t shift);
+  // ブートキーボードのレポート（生バイトのビュー）。既定の実装は構造体へ詰め直して従来のonKeyboard()を呼ぶ
+  virtual void onKeyboardReport(const usb_report_view_t &report, const usb_report_view_t &last_report);
   virtual void onKeyboard(hid_keyboard_report_t report, hid_keyboard_report_t last_report);
   virtual void onKeyboardKey(uint8_t ascii, uint8_t keycode, uint8_t modifier);
+  // キー状態ビットマップの差分（押下・解放）ごとに呼ばれる
+  virtual void onKeyboardKeyChange(uint8_t keycode, bool pressed, const hid_key_bitmap_t &keys);
+  // ベンダー独自形式のキーボードレポート（DOIO KB16等）をキー状態へ変換する
+  // trueを返すとkeysをこのインターフェースのキー状態として使い、標準のデコードは行わない
+  virtual bool onDecodeVendorKeyboard(const usb_report_view_t &report, const usb_report_view_t &last_report, hid_key_bitmap_t &keys) { return false; }
+  // Consumer Control（0x0C）のUsageの押下・解放（音量・メディアキー）
+  virtual void onConsumerControl(uint16_t usage, bool pressed){};
+  // System Control（Generic Desktop 0x81-0x83等）のUsageの押下・解放
+  virtual void onSystemControl(uint16_t usage, bool pressed){};
 
-  virtual void onMouse(hid_mouse_report_t report, uint8_t last_buttons);
-  virtual void onMouseButtons(hid_mouse_report_t report, uint8_t last_buttons);
-  virtual void onMouseMove(hid_mouse_report_t report);
+  virtual void onMouse(usb_mouse_report_t report, uint8_t last_buttons);
+  virtual void onMouseButtons(usb_mouse_report_t report, uint8_t last_buttons);
+  virtual void onMouseMove(usb_mouse_report_t report);
 
-  void _onDataGamepad();
+  // ゲームパッド（Joystick/Gamepad）のレポートをレイアウト表から正規化してonGamepad()へ渡す
+  void _onDataGamepad(endpoint_data_t *endpoint_data, const hid_report_map_t &map, const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, int64_t timestamp_us);
+  virtual void onGamepad(const usb_gamepad_state_t &state){};
 
   void setHIDLocal(hid_local_enum_t code);
 
@@ -0,0 +1,103 @@
+#include "EventLog.h"
+
+EventLog eventLog;
+
+// イベントIDごとの書式（引数は常にa0, a1, a2の順で渡す）
+static const char *const eventFormats[] = {
+  "log dropped=%u",                                  // EVT_LOG_DROPPED
+  "RX dev=%u ep=0x%02x len=%u",                      // EVT_REPORT
+  "boot keyboard modifier=0x%02x",                   // EVT_BOOT_KEYBOARD
+  "mouse buttons=0x%02x x=%d y=%d",                  // EVT_MOUSE
+  "key 0x%02x %s",                                   // EVT_KEY_CHANGE
+  "key processed ascii=0x%02x keycode=0x%02x modifier=0x%02x",  // EVT_KEY
+  "key 0x%02x bounce held back (%uus)",              // EVT_KEY_DEBOUNCE
+  "consumer usage=0x%03x %s",                        // EVT_CONSUMER
+  "system usage=0x%02x %s",                          // EVT_SYSTEM
+  "KB16 invalid report reserved=0x%02x",             // EVT_KB16_INVALID
+  "KB16 key (%u,%u) state=0x%06x",                   // EVT_KB16_KEY
+  "BLE key 0x%02x %s modifier=0x%02x",              // EVT_BLE_SEND
+  "BLE media usage=0x%03x %s",                       // EVT_BLE_MEDIA
+  "BLE unsupported 0x%03x",                          // EVT_BLE_UNSUPPORTED
+  "BLE not connected, key 0x%02x queued",            // EVT_BLE_NOT_CONNECTED
+  "gamepad buttons=0x%08x hat=%u x=%d",              // EVT_GAMEPAD
+  "BLE link event=%u conn=%u value=%u",              // EVT_BLE_LINK
+};
+static_assert(sizeof(eventFormats) / sizeof(eventFormats[0]) == EVT_COUNT, "eventFormats must match event_log_id_t");
+
+void EventLog::_print(const event_log_record_t &record) {
+#if EVENT_LOG_BINARY
+  // 同期用の2バイトに続けてレコードをそのまま送る
+  static const uint8_t sync[2] = { 0xa5, 0x5a };
+  Serial.write(sync, sizeof(sync));
+  Serial.write((const uint8_t *)&record, sizeof(record));
+#else
+  if (record.id >= EVT_COUNT) {
+    return;
+  }
+
+  // 押下／解放を表す引数は文字列にして渡す
+  uint32_t a1 = record.args[1];
+  bool pressed_arg = (record.id == EVT_KEY_CHANGE || record.id == EVT_CONSUMER || record.id == EVT_SYSTEM || record.id == EVT_BLE_MEDIA ||
+                      record.id == EVT_BLE_SEND);
+
+  Serial.printf("[%10u] ", (unsigned)record.timestamp_us);
+  if (pressed_arg) {
+    Serial.printf(eventFormats[record.id], (unsigned)record.args[0], a1 ? "press" : "release", (unsigned)record.args[2]);
+  } else if (record.id == EVT_MOUSE) {
+    Serial.printf(eventFormats[record.id], (unsigned)record.args[0], (int)(int32_t)a1, (int)(int32_t)record.args[2]);
+  } else if (record.id == EVT_GAMEPAD) {
+    Serial.printf(eventFormats[record.id], (unsigned)record.args[0], (unsigned)a1, (int)(int32_t)record.args[2]);
+  } else {
+    Serial.printf(eventFormats[record.id], (unsigned)record.args[0], (unsigned)a1, (unsigned)record.args[2]);
+  }
+
+  if (record.length > 0) {
+    Serial.print(" [");
+    for (uint8_t i = 0; i < record.length; i++) {
+      Serial.printf(i == 0 ? "%02x" : " %02x", record.data[i]);
+    }
+    Serial.print("]");
+  }
+  Serial.println();
+#endif
+}
+
+uint32_t EventLog::drain(uint32_t max) {
+  uint32_t count = 0;
+
+  // 前回以降にリング満杯で捨てたレコードがあれば先に知らせる
+  uint32_t dropped = ring.overflowCount();
+  if (dropped != reportedDropped) {
+    event_log_record_t record = {};
+    record.timestamp_us = (uint32_t)esp_timer_get_time();
+    record.id = EVT_LOG_DROPPED;
+    record.args[0] = dropped - reportedDropped;
+    reportedDropped = dropped;
+    _print(record);
+  }
+
+  event_log_record_t *record;
+  while (count < max && (record = ring.peek()) != nullptr) {
+    _print(*record);
+    ring.release();
+    count++;
+  }
+  return count;
+}
+
+void EventLog::_drainTask(void *arg) {
+  EventLog *log = (EventLog *)arg;
+  while (true) {
+    // 空になったら少し待つ（書き込み側を起こす必要はない）
+    if (log->drain(16) == 0) {
+      vTaskDelay(pdMS_TO_TICKS(10));
+    }
+  }
+}
+
+void EventLog::beginTask(BaseType_t core, UBaseType_t priority) {
+  if (this->taskHandle != NULL) {
+    return;
+  }
+  xTaskCreatePinnedToCore(_drainTask, "eventLog", 4096, this, priority, &this->taskHandle, core);
+}
@@ -0,0 +1,118 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "SpscRing.h"
+
+// イベントログの設定（build_flagsで上書き可能）
+#ifndef EVENT_LOG_ENABLED
+#define EVENT_LOG_ENABLED 1           // 0ならEVENT_LOG*()は何も生成しない
+#endif
+#ifndef EVENT_LOG_RING_SIZE
+#define EVENT_LOG_RING_SIZE 128       // リングのレコード数（2のべき乗）
+#endif
+#ifndef EVENT_LOG_BINARY
+#define EVENT_LOG_BINARY 0            // 1ならテキスト化せずレコードをそのままSerialへ流す（ホスト側で整形）
+#endif
+#ifndef EVENT_LOG_TASK_CORE
+#define EVENT_LOG_TASK_CORE 0         // 吐き出しタスクのコア（loop()と別のコア）
+#endif
+#ifndef EVENT_LOG_TASK_PRIORITY
+#define EVENT_LOG_TASK_PRIORITY 1     // 吐き出しタスクの優先度（USBホストタスクより低く）
+#endif
+#define EVENT_LOG_DATA_SIZE 16        // 1レコードに添付できる生データのバイト数
+
+// イベントID（整形用の書式はEventLog.cppのeventFormats[]に同じ順で並べる）
+enum event_log_id_t : uint8_t {
+  EVT_LOG_DROPPED = 0,     // a0=リング満杯で捨てたレコード数
+  EVT_REPORT,              // a0=デバイス a1=エンドポイント a2=長さ + 生データ
+  EVT_BOOT_KEYBOARD,       // a0=modifier + キーコード6バイト
+  EVT_MOUSE,               // a0=ボタン a1=X a2=Y
+  EVT_KEY_CHANGE,          // a0=キーコード a1=押下
+  EVT_KEY,                 // a0=ASCII a1=キーコード a2=modifier
+  EVT_KEY_DEBOUNCE,        // a0=キーコード a1=前回の変化からの経過us
+  EVT_CONSUMER,            // a0=Usage a1=押下
+  EVT_SYSTEM,              // a0=Usage a1=押下
+  EVT_KB16_INVALID,        // a0=reservedバイト
+  EVT_KB16_KEY,            // a0=行 a1=列 a2=(押下<<16)|(バイト位置<<8)|値
+  EVT_BLE_SEND,            // a0=キーコード a1=押下 a2=modifier + 送った入力レポート8バイト
+  EVT_BLE_MEDIA,           // a0=Usage a1=押下
+  EVT_BLE_UNSUPPORTED,     // a0=キーコードまたはUsage
+  EVT_BLE_NOT_CONNECTED,   // a0=キーコード（未接続の間に送信待ちへ積んだ）
+  EVT_GAMEPAD,             // a0=ボタン a1=ハット a2=X（正規化後）
+  EVT_BLE_LINK,            // a0=ble_link_event_type_t a1=接続ハンドル a2=接続間隔（MTUの交換ならMTU）
+  EVT_COUNT
+};
+
+// 固定長のログレコード（書式化は吐き出し側で行う）
+struct event_log_record_t {
+  uint32_t timestamp_us;   // esp_timerの下位32ビット
+  uint8_t id;              // event_log_id_t
+  uint8_t length;          // data[]の有効バイト数
+  uint16_t reserved;
+  uint32_t args[3];
+  uint8_t data[EVENT_LOG_DATA_SIZE];
+};
+
+// 書き込みは「書き込み側1つ」（processReports()を回すタスク）からのみ行う
+// 書き込みは固定長レコードをリングへ詰めるだけで、ヒープ確保もUART待ちもしない
+class EventLog {
+public:
+  void write(uint8_t id, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0) {
+    event_log_record_t *record = ring.acquire();
+    if (record == nullptr) {
+      return;
+    }
+    record->timestamp_us = (uint32_t)esp_timer_get_time();
+    record->id = id;
+    record->length = 0;
+    record->args[0] = a0;
+    record->args[1] = a1;
+    record->args[2] = a2;
+    ring.commit();
+  }
+
+  void writeData(uint8_t id, uint32_t a0, uint32_t a1, uint32_t a2, const uint8_t *data, uint8_t length) {
+    event_log_record_t *record = ring.acquire();
+    if (record == nullptr) {
+      return;
+    }
+    record->timestamp_us = (uint32_t)esp_timer_get_time();
+    record->id = id;
+    record->length = (length > EVENT_LOG_DATA_SIZE) ? EVENT_LOG_DATA_SIZE : length;
+    record->args[0] = a0;
+    record->args[1] = a1;
+    record->args[2] = a2;
+    memcpy(record->data, data, record->length);
+    ring.commit();
+  }
+
+  // 溜まったレコードを最大max件だけ整形して出力する（吐き出しタスクを使わない場合はloop()から呼ぶ）
+  uint32_t drain(uint32_t max);
+  // 低優先度の吐き出しタスクを起動する
+  void beginTask(BaseType_t core = EVENT_LOG_TASK_CORE, UBaseType_t priority = EVENT_LOG_TASK_PRIORITY);
+
+  uint32_t droppedCount() const { return ring.overflowCount(); }
+  uint32_t highWaterMark() const { return ring.highWaterMark(); }
+
+private:
+  static void _drainTask(void *arg);
+  void _print(const event_log_record_t &record);
+
+  SpscRing<event_log_record_t, EVENT_LOG_RING_SIZE> ring;
+  uint32_t reportedDropped = 0;
+  TaskHandle_t taskHandle = NULL;
+};
+
+extern EventLog eventLog;
+
+#if EVENT_LOG_ENABLED
+#define EVENT_LOG(id, ...) eventLog.write((id), ##__VA_ARGS__)
+#define EVENT_LOG_DATA(id, a0, a1, a2, data, length) eventLog.writeData((id), (a0), (a1), (a2), (data), (length))
+#else
+#define EVENT_LOG(id, ...) do {} while (0)
+#define EVENT_LOG_DATA(id, a0, a1, a2, data, length) do {} while (0)
+#endif
+
+#endif // EVENT_LOG_H
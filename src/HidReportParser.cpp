@@ -0,0 +1,566 @@
+#include "HidReportParser.h"
+
+// 解析中に保持するグローバルアイテム（PUSH/POPの対象）
+struct hid_parser_global_t {
+  uint16_t usage_page;
+  int32_t logical_min;
+  int32_t logical_max;
+  uint16_t report_size;   // ベンダー・フィーチャーレポートでは256以上もある
+  uint16_t report_count;
+  uint8_t report_id;
+};
+
+#define HID_PARSER_MAX_USAGES     16
+#define HID_PARSER_MAX_STACK      4
+#define HID_PARSER_MAX_COLLECTION 8
+
+// アイテムのデータ部（リトルエンディアン）を取り出す
+static uint32_t hid_item_udata(const uint8_t *p, uint8_t size) {
+  uint32_t val = 0;
+  for (uint8_t i = 0; i < size; i++) {
+    val |= (uint32_t)p[i] << (8 * i);
+  }
+  return val;
+}
+
+static int32_t hid_item_sdata(const uint8_t *p, uint8_t size) {
+  uint32_t val = hid_item_udata(p, size);
+  if (size == 1) {
+    return (int8_t)val;
+  } else if (size == 2) {
+    return (int16_t)val;
+  }
+  return (int32_t)val;
+}
+
+void hid_report_map_t::clear() {
+  valid.store(false, std::memory_order_relaxed);
+  uses_report_id = false;
+  report_count = 0;
+  field_count = 0;
+}
+
+const hid_report_info_t *hid_report_map_t::find(uint8_t type, uint8_t report_id) const {
+  for (uint8_t i = 0; i < report_count; i++) {
+    if (reports[i].type == type && reports[i].report_id == report_id) {
+      return &reports[i];
+    }
+  }
+  return NULL;
+}
+
+const hid_report_info_t *hid_report_map_t::match(uint8_t type, const uint8_t *data, uint16_t length, const uint8_t **payload, uint16_t *payload_len) const {
+  if (!isValid() || length == 0) {
+    return NULL;
+  }
+
+  if (uses_report_id) {
+    *payload = data + 1;
+    *payload_len = length - 1;
+    return find(type, data[0]);
+  }
+
+  *payload = data;
+  *payload_len = length;
+  return find(type, 0);
+}
+
+const hid_field_t *hid_report_map_t::findUsage(const hid_report_info_t &info, uint16_t usage_page, uint16_t usage, uint8_t *index) const {
+  for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+    const hid_field_t &field = fields[f];
+    if (!(field.flags & HID_FIELD_VARIABLE) || field.usage_page != usage_page) {
+      continue;
+    }
+    if (usage < field.usage_min || usage > field.usage_max) {
+      continue;
+    }
+    uint16_t n = usage - field.usage_min;
+    if (n >= field.count) {
+      continue;
+    }
+    *index = n;
+    return &field;
+  }
+  return NULL;
+}
+
+bool hid_report_map_t::hasUsagePage(const hid_report_info_t &info, uint16_t usage_page) const {
+  for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+    if (fields[f].usage_page == usage_page) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool hid_report_map_t::decodeKeys(const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, hid_key_bitmap_t &keys) const {
+  bool has_keys = false;
+  keys.clear();
+
+  for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+    const hid_field_t &field = fields[f];
+    if (field.usage_page != HID_USAGE_PAGE_KEYBOARD) {
+      continue;
+    }
+    has_keys = true;
+
+    if (field.flags & HID_FIELD_VARIABLE) {
+      // ビットマップ形式（修飾キーやNKRO）: 要素iがUsage usage_min+iの押下状態
+      for (uint8_t i = 0; i < field.count; i++) {
+        uint16_t usage = field.usage_min + i;
+        if (usage > 0xff) {
+          break;
+        }
+        if (hid_extract_bits(payload, payload_len, field.bit_offset + (uint16_t)i * field.bit_size, field.bit_size)) {
+          keys.set(usage);
+        }
+      }
+    } else {
+      // 配列形式（ブートキーボードの6キー等）: 各要素の値が押下中のUsage
+      for (uint8_t i = 0; i < field.count; i++) {
+        int32_t value = hid_field_value(field, payload, payload_len, i);
+        if (value < field.logical_min || value > field.logical_max) {
+          continue;
+        }
+        uint32_t usage = field.usage_min + (value - field.logical_min);
+        if (usage == HID_KEY_NONE || usage > 0xff) {
+          continue;
+        }
+        if (usage <= 0x03) {
+          // ErrorRollOver/POSTFail/ErrorUndefined: 押下状態が不定なので前回の状態を維持させる
+          return false;
+        }
+        keys.set(usage);
+      }
+    }
+  }
+  return has_keys;
+}
+
+uint8_t hid_report_map_t::decodeUsages(const hid_report_info_t &info, uint16_t usage_page, const uint8_t *payload, uint16_t payload_len, uint16_t *usages, uint8_t max_usages) const {
+  uint8_t count = 0;
+
+  for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+    const hid_field_t &field = fields[f];
+    if (field.usage_page != usage_page) {
+      continue;
+    }
+
+    for (uint8_t i = 0; i < field.count && count < max_usages; i++) {
+      int32_t value = hid_field_value(field, payload, payload_len, i);
+      uint32_t usage;
+      if (field.flags & HID_FIELD_VARIABLE) {
+        // ビット形式: 要素iがUsage usage_min+iのオン／オフ
+        if (value == 0) {
+          continue;
+        }
+        usage = field.usage_min + i;
+        if (usage > field.usage_max) {
+          usage = field.usage_max;
+        }
+      } else {
+        // 配列形式: 要素の値が押下中のUsage（0は「押下なし」）
+        if (value < field.logical_min || value > field.logical_max) {
+          continue;
+        }
+        usage = field.usage_min + (value - field.logical_min);
+        if (usage == 0 || usage > field.usage_max) {
+          continue;
+        }
+      }
+      usages[count++] = usage;
+    }
+  }
+  return count;
+}
+
+uint16_t hid_report_map_t::encodeUsageBits(const hid_report_info_t &info, uint16_t usage_page, uint32_t usage_bits, uint8_t *payload, uint16_t payload_size) const {
+  // レポートIDを使うデバイスでは、SET_REPORTのデータも先頭1バイトがレポートID
+  uint8_t prefix = uses_report_id ? 1 : 0;
+  uint16_t length = prefix + (info.bit_length + 7) / 8;
+  if (length > payload_size) {
+    return 0;
+  }
+  memset(payload, 0, length);
+  if (prefix) {
+    payload[0] = info.report_id;
+  }
+
+  for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+    const hid_field_t &field = fields[f];
+    if (field.usage_page != usage_page || !(field.flags & HID_FIELD_VARIABLE)) {
+      continue;
+    }
+    for (uint8_t i = 0; i < field.count; i++) {
+      uint32_t usage = field.usage_min + i;
+      if (usage == 0 || usage > 32 || usage > field.usage_max || !((usage_bits >> (usage - 1)) & 1)) {
+        continue;
+      }
+      // 1ビット目（LSB）を立てる（Report Sizeが2以上でも値は1）
+      uint16_t bit = field.bit_offset + (uint16_t)i * field.bit_size;
+      payload[prefix + (bit >> 3)] |= 1 << (bit & 7);
+    }
+  }
+  return length;
+}
+
+// Applicationコレクションとフィールドのページからレポートの種別を決める
+static uint8_t hid_report_kind(const hid_report_map_t &map, const hid_report_info_t &info) {
+  if (info.type != HID_REPORT_TYPE_INPUT) {
+    return HID_REPORT_KIND_OTHER;
+  }
+  if (info.usage_page == HID_USAGE_PAGE_CONSUMER) {
+    return HID_REPORT_KIND_CONSUMER;
+  }
+  if (info.usage_page == HID_USAGE_PAGE_DESKTOP) {
+    if (info.usage == HID_USAGE_DESKTOP_MOUSE || info.usage == HID_USAGE_DESKTOP_POINTER) {
+      return HID_REPORT_KIND_MOUSE;
+    }
+    if (info.usage == HID_USAGE_DESKTOP_SYSTEM_CONTROL) {
+      return HID_REPORT_KIND_SYSTEM;
+    }
+    if (info.usage == HID_USAGE_DESKTOP_JOYSTICK || info.usage == HID_USAGE_DESKTOP_GAMEPAD || info.usage == 0x08 /* Multi-axis Controller */) {
+      return HID_REPORT_KIND_GAMEPAD;
+    }
+  }
+  if (map.hasUsagePage(info, HID_USAGE_PAGE_KEYBOARD)) {
+    return HID_REPORT_KIND_KEYBOARD;
+  }
+  return HID_REPORT_KIND_OTHER;
+}
+
+bool hid_report_map_t::parse(const uint8_t *desc, uint16_t length) {
+  clear();
+
+  hid_parser_global_t global = {};
+  hid_parser_global_t stack[HID_PARSER_MAX_STACK];
+  uint8_t stack_depth = 0;
+
+  // ローカルアイテム（メインアイテムごとにリセット）
+  uint32_t usages[HID_PARSER_MAX_USAGES];
+  uint8_t usage_count = 0;
+  uint32_t usage_min = 0;
+  uint32_t usage_max = 0;
+  bool has_usage_range = false;
+
+  // コレクションの入れ子（Applicationコレクションの判定用）
+  uint32_t collection_usage[HID_PARSER_MAX_COLLECTION];
+  uint8_t collection_type[HID_PARSER_MAX_COLLECTION];
+  uint8_t collection_depth = 0;
+  uint32_t application_usage = 0;
+
+  // フィールドがどのレポートに属するか（最後にレポート順へ並べ替える）
+  uint8_t owner[HID_PARSER_MAX_FIELDS];
+  bool truncated = false;
+
+  for (uint16_t i = 0; i < length;) {
+    uint8_t prefix = desc[i];
+
+    // ロングアイテムは読み飛ばす
+    if (prefix == 0xfe) {
+      if (i + 1 >= length) {
+        break;
+      }
+      i += 3 + desc[i + 1];
+      continue;
+    }
+
+    uint8_t size = prefix & 0x03;
+    if (size == 3) {
+      size = 4;
+    }
+    if (i + 1 + size > length) {
+      break;
+    }
+
+    const uint8_t *data = &desc[i + 1];
+    uint8_t item = prefix & 0xfc;  // bTag + bType
+    uint32_t udata = hid_item_udata(data, size);
+    i += 1 + size;
+
+    switch (item) {
+      // ---- グローバルアイテム ----
+      case 0x04:  // USAGE_PAGE
+        global.usage_page = udata;
+        break;
+      case 0x14:  // LOGICAL_MINIMUM
+        global.logical_min = hid_item_sdata(data, size);
+        break;
+      case 0x24:  // LOGICAL_MAXIMUM
+        global.logical_max = hid_item_sdata(data, size);
+        // 最小値が非負なら最大値は符号なしとして扱う（例: 0x00〜0xFF）
+        if (global.logical_min >= 0 && global.logical_max < 0) {
+          global.logical_max = (int32_t)udata;
+        }
+        break;
+      case 0x74:  // REPORT_SIZE
+        global.report_size = (udata > 0xffff) ? 0xffff : udata;
+        break;
+      case 0x94:  // REPORT_COUNT
+        global.report_count = (udata > 0xffff) ? 0xffff : udata;
+        break;
+      case 0x84:  // REPORT_ID
+        global.report_id = udata;
+        uses_report_id = true;
+        break;
+      case 0xa4:  // PUSH
+        if (stack_depth < HID_PARSER_MAX_STACK) {
+          stack[stack_depth++] = global;
+        }
+        break;
+      case 0xb4:  // POP
+        if (stack_depth > 0) {
+          global = stack[--stack_depth];
+        }
+        break;
+
+      // ---- ローカルアイテム ----
+      case 0x08:  // USAGE
+        if (usage_count < HID_PARSER_MAX_USAGES) {
+          // 4バイト指定なら上位16ビットがUsage Page
+          usages[usage_count++] = (size == 4) ? udata : (((uint32_t)global.usage_page << 16) | udata);
+        }
+        break;
+      case 0x18:  // USAGE_MINIMUM
+        usage_min = (size == 4) ? udata : (((uint32_t)global.usage_page << 16) | udata);
+        has_usage_range = true;
+        break;
+      case 0x28:  // USAGE_MAXIMUM
+        usage_max = (size == 4) ? udata : (((uint32_t)global.usage_page << 16) | udata);
+        has_usage_range = true;
+        break;
+
+      // ---- メインアイテム ----
+      case 0xa0:  // COLLECTION
+        if (collection_depth < HID_PARSER_MAX_COLLECTION) {
+          uint32_t usage = (usage_count > 0) ? usages[0] : usage_min;
+          collection_usage[collection_depth] = usage;
+          collection_type[collection_depth] = udata;
+          collection_depth++;
+          if (udata == 0x01) {
+            application_usage = usage;
+          }
+        }
+        usage_count = 0;
+        has_usage_range = false;
+        break;
+
+      case 0xc0:  // END_COLLECTION
+        if (collection_depth > 0) {
+          collection_depth--;
+          // 外側のApplicationコレクションに戻す
+          application_usage = 0;
+          for (uint8_t c = 0; c < collection_depth; c++) {
+            if (collection_type[c] == 0x01) {
+              application_usage = collection_usage[c];
+            }
+          }
+        }
+        usage_count = 0;
+        has_usage_range = false;
+        break;
+
+      case 0x80:  // INPUT
+      case 0x90:  // OUTPUT
+      case 0xb0:  // FEATURE
+        {
+          uint8_t type = (item == 0x80) ? HID_REPORT_TYPE_INPUT : (item == 0x90) ? HID_REPORT_TYPE_OUTPUT
+                                                                                : HID_REPORT_TYPE_FEATURE;
+
+          // レポート（ID・種別）を探す、なければ追加
+          int8_t report_index = -1;
+          for (uint8_t r = 0; r < report_count; r++) {
+            if (reports[r].report_id == global.report_id && reports[r].type == type) {
+              report_index = r;
+              break;
+            }
+          }
+          if (report_index < 0) {
+            if (report_count >= HID_PARSER_MAX_REPORTS) {
+              truncated = true;
+              usage_count = 0;
+              has_usage_range = false;
+              break;
+            }
+            report_index = report_count++;
+            hid_report_info_t &info = reports[report_index];
+            info.report_id = global.report_id;
+            info.type = type;
+            info.field_start = 0;
+            info.field_count = 0;
+            info.kind = HID_REPORT_KIND_OTHER;
+            info.bit_length = 0;
+            info.usage_page = application_usage >> 16;
+            info.usage = application_usage & 0xffff;
+          }
+
+          hid_report_info_t &info = reports[report_index];
+          uint16_t bit_offset = info.bit_length;
+          uint32_t bit_length = (uint32_t)info.bit_length + (uint32_t)global.report_size * global.report_count;
+          if (bit_length > 0xffff) {
+            // ビット位置が16ビットに収まらないレポートは、ここから先のオフセットが正しく出せない
+            truncated = true;
+            usage_count = 0;
+            has_usage_range = false;
+            break;
+          }
+          info.bit_length = bit_length;
+
+          // 定数（パディング）はオフセットを進めるだけ
+          uint8_t flags = udata & (HID_FIELD_CONSTANT | HID_FIELD_VARIABLE | HID_FIELD_RELATIVE);
+          if ((flags & HID_FIELD_CONSTANT) || global.report_count == 0 || global.report_size == 0) {
+            usage_count = 0;
+            has_usage_range = false;
+            break;
+          }
+          // 32ビットを超える要素は値として取り出せないので、フィールドにせずオフセットだけ進める
+          // （レイアウトは正しいので、ディスクリプタを取り直しても変わらない。解析は完了扱い）
+          if (global.report_size > 32) {
+            usage_count = 0;
+            has_usage_range = false;
+            break;
+          }
+
+          // Usageの並びをフィールドへ落とし込む
+          // 範囲指定または連続したUsageは1フィールド、飛び飛びのVariableはUsageごとに分ける
+          bool contiguous = true;
+          for (uint8_t u = 1; u < usage_count; u++) {
+            if (usages[u] != usages[u - 1] + 1) {
+              contiguous = false;
+              break;
+            }
+          }
+
+          uint8_t pieces = 1;
+          if (!has_usage_range && usage_count > 1 && !contiguous && (flags & HID_FIELD_VARIABLE)) {
+            pieces = (usage_count < global.report_count) ? usage_count : global.report_count;
+          }
+
+          for (uint8_t n = 0; n < pieces; n++) {
+            if (field_count >= HID_PARSER_MAX_FIELDS) {
+              truncated = true;
+              break;
+            }
+
+            hid_field_t &field = fields[field_count];
+            uint32_t first;
+            uint32_t last;
+            if (has_usage_range) {
+              first = usage_min;
+              last = usage_max;
+            } else if (usage_count == 0) {
+              first = (uint32_t)global.usage_page << 16;
+              last = first;
+            } else if (pieces > 1) {
+              first = usages[n];
+              last = usages[n];
+            } else {
+              first = usages[0];
+              last = usages[usage_count - 1];
+              for (uint8_t u = 0; u < usage_count; u++) {
+                if ((usages[u] & 0xffff) < (first & 0xffff)) {
+                  first = usages[u];
+                }
+                if ((usages[u] & 0xffff) > (last & 0xffff)) {
+                  last = usages[u];
+                }
+              }
+            }
+
+            // 最後のUsageより要素が多い場合、残りはすべて最後のUsageになる
+            uint16_t count = 1;
+            if (pieces == 1) {
+              count = global.report_count;
+            } else if (n == pieces - 1) {
+              count = global.report_count - n;
+            }
+            // 要素数は255までしか持てないので、それ以降の要素は読まない（オフセットはbit_lengthで正しく進む）
+            if (count > 0xff) {
+              count = 0xff;
+            }
+
+            field.usage_page = first >> 16;
+            field.usage_min = first & 0xffff;
+            field.usage_max = last & 0xffff;
+            field.bit_offset = bit_offset + (uint16_t)n * global.report_size;
+            field.bit_size = global.report_size;
+            field.count = count;
+            field.flags = flags;
+            field.logical_min = global.logical_min;
+            field.logical_max = global.logical_max;
+            owner[field_count] = report_index;
+            field_count++;
+          }
+
+          usage_count = 0;
+          has_usage_range = false;
+        }
+        break;
+
+      default:
+        // DELIMITERやUNIT等はデコードに不要なので無視
+        break;
+    }
+  }
+
+  // レポートごとにフィールドが連続するよう安定ソート（挿入ソート、要素数は少ない）
+  for (uint8_t a = 1; a < field_count; a++) {
+    hid_field_t field = fields[a];
+    uint8_t key = owner[a];
+    int8_t b = a - 1;
+    while (b >= 0 && owner[b] > key) {
+      fields[b + 1] = fields[b];
+      owner[b + 1] = owner[b];
+      b--;
+    }
+    fields[b + 1] = field;
+    owner[b + 1] = key;
+  }
+
+  for (uint8_t f = 0; f < field_count; f++) {
+    hid_report_info_t &info = reports[owner[f]];
+    if (info.field_count == 0) {
+      info.field_start = f;
+    }
+    info.field_count++;
+  }
+
+  for (uint8_t r = 0; r < report_count; r++) {
+    reports[r].kind = hid_report_kind(*this, reports[r]);
+  }
+
+  // 表を書き終えてから公開する
+  valid.store(report_count > 0, std::memory_order_release);
+  return report_count > 0 && !truncated;
+}
+
+void hid_report_map_t::print() const {
+#if (ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO)
+  printf("[HID MAP] reports=%d fields=%d report_id=%s\n", report_count, field_count, uses_report_id ? "yes" : "no");
+  for (uint8_t r = 0; r < report_count; r++) {
+    const hid_report_info_t &info = reports[r];
+    printf("[HID MAP] %s id=%d bits=%d app=%04x:%04x kind=%d\n",
+           (info.type == HID_REPORT_TYPE_INPUT) ? "INPUT  " : (info.type == HID_REPORT_TYPE_OUTPUT) ? "OUTPUT "
+                                                                                                    : "FEATURE",
+           info.report_id,
+           info.bit_length,
+           info.usage_page,
+           info.usage,
+           info.kind);
+    for (uint8_t f = info.field_start; f < info.field_start + info.field_count; f++) {
+      const hid_field_t &field = fields[f];
+      printf("[HID MAP]   page=%04x usage=%04x-%04x bit=%d size=%d count=%d %s%s logical=%ld..%ld\n",
+             field.usage_page,
+             field.usage_min,
+             field.usage_max,
+             field.bit_offset,
+             field.bit_size,
+             field.count,
+             (field.flags & HID_FIELD_VARIABLE) ? "Var" : "Ary",
+             (field.flags & HID_FIELD_RELATIVE) ? ",Rel" : "",
+             (long)field.logical_min,
+             (long)field.logical_max);
+    }
+  }
+#endif
+}
@@ -0,0 +1,127 @@
+#ifndef HID_REPORT_PARSER_H
+#define HID_REPORT_PARSER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <class/hid/hid.h>
+
+// 1インターフェースあたりの上限（超えた分は解析を打ち切る）
+#define HID_PARSER_MAX_FIELDS  40
+#define HID_PARSER_MAX_REPORTS 8
+
+// フィールド属性（Input/Output/Featureアイテムのデータビットと同じ並び）
+#define HID_FIELD_CONSTANT 0x01
+#define HID_FIELD_VARIABLE 0x02
+#define HID_FIELD_RELATIVE 0x04
+
+// レポートの種別（Applicationコレクションとフィールドから解析時に決める、デコーダの振り分けに使う）
+enum hid_report_kind_t {
+  HID_REPORT_KIND_OTHER = 0,
+  HID_REPORT_KIND_KEYBOARD,   // Keyboardページのフィールドを含む
+  HID_REPORT_KIND_MOUSE,      // Generic Desktop / Mouse・Pointer
+  HID_REPORT_KIND_CONSUMER,   // Consumer Control（音量・メディアキー）
+  HID_REPORT_KIND_SYSTEM,     // Generic Desktop / System Control（電源・スリープ）
+  HID_REPORT_KIND_GAMEPAD,    // Generic Desktop / Joystick・Gamepad・Multi-axis Controller
+};
+
+// レポート内の1フィールド（同じ属性の要素がcount個並ぶ）
+struct hid_field_t {
+  uint16_t usage_page;
+  uint16_t usage_min;   // Variable: 要素iのUsageはusage_min+i / Array: 値の取りうるUsage範囲
+  uint16_t usage_max;
+  uint16_t bit_offset;  // レポートIDを除いたペイロード先頭からのビット位置
+  uint8_t bit_size;     // 1要素のビット数（Report Size、32以下）
+  uint8_t count;        // 要素数（Report Count）
+  uint8_t flags;        // HID_FIELD_*
+  int32_t logical_min;
+  int32_t logical_max;
+};
+
+// レポートID・種別ごとのフィールド範囲
+struct hid_report_info_t {
+  uint8_t report_id;    // レポートIDを使わないデバイスでは0
+  uint8_t type;         // HID_REPORT_TYPE_INPUT / OUTPUT / FEATURE
+  uint8_t field_start;  // fields[]内の先頭インデックス
+  uint8_t field_count;
+  uint8_t kind;         // hid_report_kind_t
+  uint16_t bit_length;  // ペイロード長（ビット、パディング含む）
+  uint16_t usage_page;  // 所属するApplicationコレクション
+  uint16_t usage;
+};
+
+// Keyboard/Keypadページ（0x07）の全Usage分のキー状態（1ビット1キー、0xE0-0xE7は修飾キー）
+struct hid_key_bitmap_t {
+  uint32_t word[8];
+
+  void clear() { memset(word, 0, sizeof(word)); }
+  bool test(uint8_t usage) const { return (word[usage >> 5] >> (usage & 31)) & 1; }
+  void set(uint8_t usage) { word[usage >> 5] |= (1UL << (usage & 31)); }
+  bool any() const {
+    uint32_t acc = 0;
+    for (uint8_t w = 0; w < 8; w++) {
+      acc |= word[w];
+    }
+    return acc != 0;
+  }
+  // 修飾キー（0xE0-0xE7）をブートレポートのmodifierバイトとして取り出す
+  uint8_t modifier() const { return word[7] & 0xff; }
+};
+
+// 1インターフェース分のレポートディスクリプタ解析結果
+// 列挙時に一度だけ作成し、以降のレポートデコードはこの表をたどるだけにする
+// 表はUSBクライアントタスクが書き、デコードするloop()が読む。書き込みはvalidがfalseの間だけ行い、
+// 書き終えてからvalidをreleaseで立てる（読む側はisValid()のacquireで確かめてから表をたどる）
+struct hid_report_map_t {
+  std::atomic<bool> valid{false};
+  bool uses_report_id;
+  uint8_t report_count;
+  uint8_t field_count;
+  hid_report_info_t reports[HID_PARSER_MAX_REPORTS];
+  hid_field_t fields[HID_PARSER_MAX_FIELDS];
+
+  void clear();
+  bool isValid() const { return valid.load(std::memory_order_acquire); }
+  bool parse(const uint8_t *desc, uint16_t length);
+  const hid_report_info_t *find(uint8_t type, uint8_t report_id) const;
+  // 受信データの先頭（レポートID）から該当レポートを探し、IDを除いたペイロードを返す
+  const hid_report_info_t *match(uint8_t type, const uint8_t *data, uint16_t length, const uint8_t **payload, uint16_t *payload_len) const;
+  // Variableフィールドから指定Usageを探す（見つかればindexに要素番号）
+  const hid_field_t *findUsage(const hid_report_info_t &info, uint16_t usage_page, uint16_t usage, uint8_t *index) const;
+  // レポートが指定Usage Pageのフィールドを含むか
+  bool hasUsagePage(const hid_report_info_t &info, uint16_t usage_page) const;
+  // レポート中のKeyboardページのフィールドをキー状態ビットマップへ展開する
+  // （Keyboardフィールドを含まない、またはロールオーバーエラーのレポートはfalse）
+  bool decodeKeys(const hid_report_info_t &info, const uint8_t *payload, uint16_t payload_len, hid_key_bitmap_t &keys) const;
+  // 指定Usage Pageで押下中のUsageを最大max_usages個集める（Consumer/System Control用、戻り値は個数）
+  uint8_t decodeUsages(const hid_report_info_t &info, uint16_t usage_page, const uint8_t *payload, uint16_t payload_len, uint16_t *usages, uint8_t max_usages) const;
+  // 指定Usage PageのVariableフィールドへ、Usage 1-32のオン／オフ（ビットusage-1）を書き込む
+  // （出力レポート用、レポートIDを使うデバイスでは先頭にIDを付ける、戻り値はIDを含むデータ長）
+  uint16_t encodeUsageBits(const hid_report_info_t &info, uint16_t usage_page, uint32_t usage_bits, uint8_t *payload, uint16_t payload_size) const;
+  void print() const;
+};
+
+// ペイロードからbit_offset位置のbit_sizeビットを取り出す（LSBファースト、bit_sizeは32以下）
+static inline uint32_t hid_extract_bits(const uint8_t *payload, uint16_t payload_len, uint16_t bit_offset, uint8_t bit_size) {
+  uint64_t value = 0;
+  uint16_t byte = bit_offset >> 3;
+  uint8_t shift = bit_offset & 7;
+  for (uint8_t got = 0; got < bit_size + shift && byte < payload_len; got += 8, byte++) {
+    value |= (uint64_t)payload[byte] << got;
+  }
+  value >>= shift;
+  if (bit_size < 32) {
+    value &= (1ULL << bit_size) - 1;
+  }
+  return (uint32_t)value;
+}
+
+// フィールドの要素indexの値（logical_minが負なら符号拡張）
+static inline int32_t hid_field_value(const hid_field_t &field, const uint8_t *payload, uint16_t payload_len, uint8_t index) {
+  uint32_t raw = hid_extract_bits(payload, payload_len, field.bit_offset + (uint16_t)index * field.bit_size, field.bit_size);
+  if (field.logical_min < 0 && field.bit_size < 32 && (raw & (1UL << (field.bit_size - 1)))) {
+    raw |= ~((1UL << field.bit_size) - 1);
+  }
+  return (int32_t)raw;
+}
+
+#endif // HID_REPORT_PARSER_H
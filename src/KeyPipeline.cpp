@@ -0,0 +1,128 @@
+#include "KeyPipeline.h"
+#include "EventLog.h"
+
+KeyPipeline keyPipeline;
+
+static const char *const stageNames[] = { "decode", "debounce", "keymap", "output" };
+static_assert(sizeof(stageNames) / sizeof(stageNames[0]) == KEY_STAGE_COUNT, "stageNames must match key_stage_t");
+
+bool KeyPipeline::addSink(key_sink_t sink) {
+  if (this->sinkCount >= KEY_PIPELINE_MAX_SINKS) {
+    return false;
+  }
+  this->sinks[this->sinkCount++] = sink;
+  return true;
+}
+
+void KeyPipeline::_record(key_stage_t stage, uint32_t us) {
+  stage_stats_t &s = this->stats[stage];
+  s.count++;
+  s.lastUs = us;
+  if (us > s.maxUs) {
+    s.maxUs = us;
+  }
+  s.totalUs += us;
+}
+
+void KeyPipeline::submit(uint8_t usage, bool pressed, int64_t usb_us) {
+  int64_t now = esp_timer_get_time();
+
+  if (pressed) {
+    this->raw.set(usage);
+  } else {
+    this->raw.word[usage >> 5] &= ~(1UL << (usage & 31));
+  }
+
+  // 出力済みの状態に戻っただけ（保留中の変化が打ち消された）なら何もしない
+  if (this->state.test(usage) == pressed) {
+    return;
+  }
+
+#if KEY_PIPELINE_DEBOUNCE_US > 0
+  // 前回の変化から間もない変化は保留し、待ち時間が過ぎてもその状態ならpoll()で流す
+  uint32_t elapsed = (uint32_t)now - this->changeUs[usage];
+  if (elapsed < KEY_PIPELINE_DEBOUNCE_US) {
+    this->heldUsbUs[usage] = (uint32_t)usb_us;
+    this->debouncedCount++;
+    EVENT_LOG(EVT_KEY_DEBOUNCE, usage, elapsed);
+    return;
+  }
+#endif
+
+  _emit(usage, pressed, usb_us, now);
+}
+
+void KeyPipeline::poll() {
+#if KEY_PIPELINE_DEBOUNCE_US > 0
+  int64_t now = 0;
+  for (int w = 0; w < 8; w++) {
+    uint32_t changed = this->raw.word[w] ^ this->state.word[w];
+    while (changed != 0) {
+      uint8_t bit = __builtin_ctz(changed);
+      changed &= changed - 1;
+
+      uint8_t usage = (w << 5) | bit;
+      if (now == 0) {
+        now = esp_timer_get_time();
+      }
+      if ((uint32_t)now - this->changeUs[usage] >= KEY_PIPELINE_DEBOUNCE_US) {
+        // デコード段には保留した変化の元レポートからの時間（保留していた時間を含む）を残す
+        int64_t usb_us = now - (int64_t)((uint32_t)now - this->heldUsbUs[usage]);
+        _emit(usage, this->raw.test(usage), usb_us, now);
+      }
+    }
+  }
+#endif
+}
+
+void KeyPipeline::_emit(uint8_t usage, bool pressed, int64_t usb_us, int64_t now) {
+  key_event_t event = {};
+  event.usage = usage;
+  event.pressed = pressed;
+  event.usbUs = usb_us;
+  event.stageUs[KEY_STAGE_DECODE] = (uint32_t)(now - usb_us);
+
+  // チャタリング除去: 出力する状態を確定する
+  if (pressed) {
+    this->state.set(usage);
+  } else {
+    this->state.word[usage >> 5] &= ~(1UL << (usage & 31));
+  }
+  this->changeUs[usage] = (uint32_t)now;
+  int64_t debounced = esp_timer_get_time();
+  event.stageUs[KEY_STAGE_DEBOUNCE] = (uint32_t)(debounced - now);
+
+  // キーマップ: 修飾キーと表示用の文字を決める
+  event.modifier = this->state.modifier();
+  if (usage < HID_KEY_CONTROL_LEFT && this->asciiMap != NULL) {
+    bool shift = (event.modifier & (KEYBOARD_MODIFIER_LEFTSHIFT | KEYBOARD_MODIFIER_RIGHTSHIFT)) != 0;
+    event.ascii = this->asciiMap(usage, shift);
+  }
+  if (pressed) {
+    EVENT_LOG(EVT_KEY, event.ascii, usage, event.modifier);
+  }
+  int64_t mapped = esp_timer_get_time();
+  event.stageUs[KEY_STAGE_KEYMAP] = (uint32_t)(mapped - debounced);
+
+  // 出力先へ順に渡す
+  for (uint8_t i = 0; i < this->sinkCount; i++) {
+    this->sinks[i](event);
+  }
+  event.stageUs[KEY_STAGE_OUTPUT] = (uint32_t)(esp_timer_get_time() - mapped);
+
+  for (int s = 0; s < KEY_STAGE_COUNT; s++) {
+    _record((key_stage_t)s, event.stageUs[s]);
+  }
+}
+
+void KeyPipeline::printStats() const {
+  Serial.printf("[Key pipeline] events=%u debounced=%u\n", this->stats[KEY_STAGE_OUTPUT].count, this->debouncedCount);
+  for (int s = 0; s < KEY_STAGE_COUNT; s++) {
+    const stage_stats_t &st = this->stats[s];
+    Serial.printf("  %-8s last=%uus avg=%uus max=%uus\n",
+                  stageNames[s],
+                  st.lastUs,
+                  st.count ? (uint32_t)(st.totalUs / st.count) : 0,
+                  st.maxUs);
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef KEY_PIPELINE_H
+#define KEY_PIPELINE_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "HidReportParser.h"
+
+// キーパイプラインの設定（build_flagsで上書き可能）
+#ifndef KEY_PIPELINE_DEBOUNCE_US
+#define KEY_PIPELINE_DEBOUNCE_US 5000     // 同じキーの前回の変化からこれより短い変化はチャタリングとして保留する（0で無効）
+#endif
+#ifndef KEY_PIPELINE_MAX_SINKS
+#define KEY_PIPELINE_MAX_SINKS 4          // 登録できる出力先の数
+#endif
+
+// パイプラインの段（段ごとに処理時間を計測する）
+enum key_stage_t : uint8_t {
+  KEY_STAGE_DECODE = 0,   // USB受信 → デコード・キー状態の差分（リングの待ち時間を含む）
+  KEY_STAGE_DEBOUNCE,     // チャタリング除去
+  KEY_STAGE_KEYMAP,       // 文字・修飾キーの割り当て
+  KEY_STAGE_OUTPUT,       // 全出力先の処理
+  KEY_STAGE_COUNT
+};
+
+// 1回のキー状態の変化（固定長、各段はこれを書き足して次の段へ渡す）
+struct key_event_t {
+  uint8_t usage;          // Keyboardページのusage（0xE0-0xE7は修飾キー）
+  bool pressed;
+  uint8_t modifier;       // 変化を反映した後の修飾キー（ブートレポートのmodifierバイト）
+  uint8_t ascii;          // 表示用の文字（キーマップ段で決定、0なら印字不可）
+  int64_t usbUs;          // 元レポートの受信時刻
+  uint32_t stageUs[KEY_STAGE_COUNT];  // 各段の処理時間
+};
+
+// 出力先（BLE・表示・音など）、登録順に呼ばれる
+typedef void (*key_sink_t)(const key_event_t &event);
+// キーマップ段で使う文字の割り当て
+typedef uint8_t (*key_ascii_map_t)(uint8_t usage, bool shift);
+
+// デコード → キー状態の差分 → チャタリング除去 → キーマップ → 出力先 を1本につないだパイプライン
+// デコードと差分はEspUsbHost（標準ディスクリプタ・ベンダー独自形式の両方が同じキー状態ビットマップへ集まる）、
+// 以降の段をここで行う。1回の押下・解放はこの経路を1度だけ通る
+// submit()とpoll()は同じタスク（processReports()を回すloop()）から呼ぶ
+class KeyPipeline {
+public:
+  void setAsciiMap(key_ascii_map_t map) { this->asciiMap = map; }
+  bool addSink(key_sink_t sink);
+
+  // キー状態の差分を1つ流す（usb_usは元レポートの受信時刻）
+  void submit(uint8_t usage, bool pressed, int64_t usb_us);
+  // チャタリング除去で保留した変化のうち、待ち時間が過ぎたものを流す
+  void poll();
+
+  const hid_key_bitmap_t &keys() const { return this->state; }
+  void printStats() const;
+
+private:
+  void _emit(uint8_t usage, bool pressed, int64_t usb_us, int64_t now);
+  void _record(key_stage_t stage, uint32_t us);
+
+  key_ascii_map_t asciiMap = NULL;
+  key_sink_t sinks[KEY_PIPELINE_MAX_SINKS] = {};
+  uint8_t sinkCount = 0;
+
+  hid_key_bitmap_t raw = {};      // デコード段から届いた最新のキー状態
+  hid_key_bitmap_t state = {};    // 出力先へ流したキー状態
+  uint32_t changeUs[256] = {};    // キーごとに最後に流した変化の時刻（esp_timerの下位32ビット）
+  uint32_t heldUsbUs[256] = {};   // キーごとに保留した変化の元レポートの受信時刻（同上）
+
+  struct stage_stats_t {
+    uint32_t count;
+    uint32_t lastUs;
+    uint32_t maxUs;
+    uint64_t totalUs;
+  };
+  stage_stats_t stats[KEY_STAGE_COUNT] = {};
+  uint32_t debouncedCount = 0;    // 保留した変化の数
+};
+
+extern KeyPipeline keyPipeline;
+
+#endif // KEY_PIPELINE_H
@@ -0,0 +1,71 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <Arduino.h>
+#include <atomic>
+
+// 単一プロデューサ／単一コンシューマ用のロックフリーリングバッファ
+// スロットは事前確保した固定配列で、実行中にヒープ確保は行わない
+// プロデューサは acquire() で得たスロットへ直接書き込み commit() で公開する
+// コンシューマは peek() で先頭スロットを参照し、処理後に release() で返却する
+template <typename T, uint32_t N>
+class SpscRing {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+public:
+    // プロデューサ側: 書き込み先スロットを取得（満杯ならnullptr、オーバーフローを記録）
+    T* acquire() {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        if (head - tail >= N) {
+            overflowCount_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &slots_[head & (N - 1)];
+    }
+
+    // プロデューサ側: acquire()したスロットをコンシューマへ公開
+    void commit() {
+        uint32_t head = head_.load(std::memory_order_relaxed) + 1;
+        head_.store(head, std::memory_order_release);
+
+        uint32_t used = head - tail_.load(std::memory_order_relaxed);
+        if (used > highWaterMark_.load(std::memory_order_relaxed)) {
+            highWaterMark_.store(used, std::memory_order_relaxed);
+        }
+    }
+
+    // コンシューマ側: 先頭スロットを参照（空ならnullptr）
+    T* peek() {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        if (head == tail) {
+            return nullptr;
+        }
+        return &slots_[tail & (N - 1)];
+    }
+
+    // コンシューマ側: peek()したスロットを返却
+    void release() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uint32_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    static constexpr uint32_t capacity() { return N; }
+
+    // 統計: 満杯で破棄した回数と、同時に溜まった最大件数
+    uint32_t overflowCount() const { return overflowCount_.load(std::memory_order_relaxed); }
+    uint32_t highWaterMark() const { return highWaterMark_.load(std::memory_order_relaxed); }
+
+private:
+    T slots_[N];
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> overflowCount_{0};
+    std::atomic<uint32_t> highWaterMark_{0};
+};
+
+#endif // SPSC_RING_H
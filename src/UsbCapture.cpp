@@ -0,0 +1,133 @@
+#include "UsbCapture.h"
+
+#if USB_CAPTURE_ENABLED
+UsbCapture usbCapture;
+#endif
+
+// pcapngのブロック種別
+#define PCAPNG_SECTION_HEADER_BLOCK 0x0a0d0d0a
+#define PCAPNG_INTERFACE_DESCRIPTION_BLOCK 0x00000001
+#define PCAPNG_ENHANCED_PACKET_BLOCK 0x00000006
+
+void UsbCapture::begin(Print &out, BaseType_t core, UBaseType_t priority) {
+  if (this->out != NULL) {
+    return;
+  }
+
+  // Section Header Block（バイトオーダー判定用のマジック、バージョン1.0、セクション長は不明=-1）
+  struct {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int64_t section_length;
+  } shb = { 0x1a2b3c4d, 1, 0, -1 };
+
+  // Interface Description Block（タイムスタンプの分解能は既定のマイクロ秒）
+  struct {
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+  } idb = { USB_CAPTURE_LINKTYPE, 0, sizeof(usbmon_packet_t) + USB_CAPTURE_SNAPLEN };
+
+  this->out = &out;
+  _writeBlock(PCAPNG_SECTION_HEADER_BLOCK, &shb, sizeof(shb), NULL, 0);
+  _writeBlock(PCAPNG_INTERFACE_DESCRIPTION_BLOCK, &idb, sizeof(idb), NULL, 0);
+
+  xTaskCreatePinnedToCore(_drainTask, "usbCapture", 4096, this, priority, &this->taskHandle, core);
+}
+
+void UsbCapture::record(uint8_t type, uint8_t xfer_type, uint8_t devnum, uint8_t epnum, uint64_t id, int64_t timestamp_us,
+                        const uint8_t *setup, int32_t status, const uint8_t *data, uint16_t length, uint16_t requested, int32_t interval) {
+  if (this->out == NULL) {
+    return;
+  }
+  usb_capture_packet_t *packet = ring.acquire();
+  if (packet == NULL) {
+    return;
+  }
+
+  uint16_t captured = (length > USB_CAPTURE_SNAPLEN) ? USB_CAPTURE_SNAPLEN : length;
+  usbmon_packet_t &header = packet->header;
+  memset(&header, 0, sizeof(header));
+  header.id = id;
+  header.type = type;
+  header.xfer_type = xfer_type;
+  header.epnum = epnum;
+  header.devnum = devnum;
+  header.busnum = 1;
+  header.flag_setup = (setup != NULL) ? 0 : '-';
+  header.flag_data = (data != NULL && length > 0) ? 0 : ((epnum & 0x80) ? '<' : '>');
+  header.ts_sec = timestamp_us / 1000000;
+  header.ts_usec = timestamp_us % 1000000;
+  header.status = status;
+  header.length = (data != NULL) ? length : requested;
+  header.len_cap = (data != NULL) ? captured : 0;
+  if (setup != NULL) {
+    memcpy(header.setup, setup, sizeof(header.setup));
+  }
+  header.interval = interval;
+
+  packet->timestamp_us = timestamp_us;
+  if (data != NULL) {
+    memcpy(packet->data, data, captured);
+  }
+  ring.commit();
+}
+
+int32_t UsbCapture::transferStatus(usb_transfer_status_t status) {
+  switch (status) {
+    case USB_TRANSFER_STATUS_COMPLETED: return 0;
+    case USB_TRANSFER_STATUS_ERROR: return -71;       // -EPROTO
+    case USB_TRANSFER_STATUS_TIMED_OUT: return -110;  // -ETIMEDOUT
+    case USB_TRANSFER_STATUS_CANCELED: return -2;     // -ENOENT
+    case USB_TRANSFER_STATUS_STALL: return -32;       // -EPIPE
+    case USB_TRANSFER_STATUS_OVERFLOW: return -75;    // -EOVERFLOW
+    case USB_TRANSFER_STATUS_SKIPPED: return -18;     // -EXDEV
+    case USB_TRANSFER_STATUS_NO_DEVICE: return -19;   // -ENODEV
+    default: return -71;
+  }
+}
+
+void UsbCapture::_writeBlock(uint32_t type, const void *body, uint32_t body_length, const void *data, uint32_t data_length) {
+  static const uint8_t padding[3] = { 0, 0, 0 };
+  uint32_t pad = (4 - (data_length & 3)) & 3;
+  uint32_t total = 4 + 4 + body_length + data_length + pad + 4;
+
+  this->out->write((const uint8_t *)&type, 4);
+  this->out->write((const uint8_t *)&total, 4);
+  this->out->write((const uint8_t *)body, body_length);
+  if (data_length > 0) {
+    this->out->write((const uint8_t *)data, data_length);
+    this->out->write(padding, pad);
+  }
+  this->out->write((const uint8_t *)&total, 4);
+}
+
+void UsbCapture::_writePacket(const usb_capture_packet_t &packet) {
+  // Enhanced Packet Block（usbmonヘッダとデータはスロット内で連続しているのでそのまま書く）
+  uint64_t timestamp = (uint64_t)packet.timestamp_us;
+  uint32_t captured = sizeof(usbmon_packet_t) + packet.header.len_cap;
+  uint32_t original = sizeof(usbmon_packet_t) + ((packet.header.flag_data == 0) ? packet.header.length : 0);
+  struct {
+    uint32_t interface_id;
+    uint32_t timestamp_high;
+    uint32_t timestamp_low;
+    uint32_t captured_length;
+    uint32_t original_length;
+  } epb = { 0, (uint32_t)(timestamp >> 32), (uint32_t)timestamp, captured, original };
+
+  _writeBlock(PCAPNG_ENHANCED_PACKET_BLOCK, &epb, sizeof(epb), &packet.header, captured);
+}
+
+void UsbCapture::_drainTask(void *arg) {
+  UsbCapture *capture = (UsbCapture *)arg;
+  while (true) {
+    usb_capture_packet_t *packet = capture->ring.peek();
+    if (packet == NULL) {
+      vTaskDelay(pdMS_TO_TICKS(5));
+      continue;
+    }
+    capture->_writePacket(*packet);
+    capture->ring.release();
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef USB_CAPTURE_H
+#define USB_CAPTURE_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <usb/usb_host.h>
+#include "SpscRing.h"
+
+// USBキャプチャの設定（build_flagsで上書き可能）
+#ifndef USB_CAPTURE_ENABLED
+#define USB_CAPTURE_ENABLED 0         // 1ならすべての制御転送・インタラプト転送をpcapngで出力する
+#endif
+#ifndef USB_CAPTURE_RING_SIZE
+#define USB_CAPTURE_RING_SIZE 32      // 出力待ちで溜めておけるパケット数（2のべき乗）
+#endif
+#ifndef USB_CAPTURE_SNAPLEN
+#define USB_CAPTURE_SNAPLEN 256       // 1パケットで保存するデータの上限（超えた分は切り捨て、元の長さは残る）
+#endif
+// USB_CAPTURE_OUTPUT: 出力先（Print派生、例: -DUSB_CAPTURE_OUTPUT=Serial1）
+// テキストログ（Serial）と混ざるとpcapngが壊れるので既定値は持たず、専用の出力先を必ず指定する
+#if USB_CAPTURE_ENABLED && !defined(USB_CAPTURE_OUTPUT)
+#error "USB_CAPTURE_ENABLED requires USB_CAPTURE_OUTPUT (a dedicated port, not the Serial log)"
+#endif
+#ifndef USB_CAPTURE_BAUD
+#define USB_CAPTURE_BAUD 921600       // 出力先のシリアルの速度（begin()に渡す）
+#endif
+#ifndef USB_CAPTURE_TASK_CORE
+#define USB_CAPTURE_TASK_CORE 0       // 出力タスクのコア
+#endif
+#ifndef USB_CAPTURE_TASK_PRIORITY
+#define USB_CAPTURE_TASK_PRIORITY 1   // 出力タスクの優先度（USBホストタスクより低く）
+#endif
+
+// pcapngのリンクタイプ（LINKTYPE_USB_LINUX_MMAPPED、WiresharkではUSBのusbmon形式として読める）
+#define USB_CAPTURE_LINKTYPE 220
+
+// usbmonの転送種別
+#define USB_CAPTURE_XFER_INTERRUPT 1
+#define USB_CAPTURE_XFER_CONTROL 2
+
+// Linux usbmonのmmap形式ヘッダ（64バイト、リトルエンディアン）
+struct usbmon_packet_t {
+  uint64_t id;             // URBの識別子（同じ転送のSubmitとCompleteで同じ値）
+  uint8_t type;            // 'S'=Submit 'C'=Complete
+  uint8_t xfer_type;       // USB_CAPTURE_XFER_*
+  uint8_t epnum;           // エンドポイントアドレス（方向ビット込み）
+  uint8_t devnum;          // デバイスアドレス
+  uint16_t busnum;
+  uint8_t flag_setup;      // 0ならsetup[]が有効、'-'なら無し
+  uint8_t flag_data;       // 0ならデータあり、'<'/'>'なら無し
+  int64_t ts_sec;
+  int32_t ts_usec;
+  int32_t status;          // 0または負のerrno
+  uint32_t length;         // 元のデータ長
+  uint32_t len_cap;        // 保存したデータ長
+  uint8_t setup[8];
+  int32_t interval;
+  int32_t start_frame;
+  uint32_t xfer_flags;
+  uint32_t ndesc;
+};
+static_assert(sizeof(usbmon_packet_t) == 64, "usbmon header must be 64 bytes");
+
+// リングの1スロット（ヘッダとデータをそのままEnhanced Packet Blockに載せる）
+struct usb_capture_packet_t {
+  int64_t timestamp_us;
+  usbmon_packet_t header;
+  uint8_t data[USB_CAPTURE_SNAPLEN];
+};
+
+// USB転送をpcapngのストリームとして出力する
+// 記録はUSBクライアントタスク（転送コールバック・列挙処理）からのみ行い、固定長スロットへコピーするだけにする
+// 出力は低優先度タスクがPrint（Serial等）へ書き出すので、キャプチャ中もUSBタスクはブロックされない
+class UsbCapture {
+public:
+  // セクション・インターフェースのヘッダを書いてから出力タスクを起動する
+  void begin(Print &out, BaseType_t core = USB_CAPTURE_TASK_CORE, UBaseType_t priority = USB_CAPTURE_TASK_PRIORITY);
+  bool isActive() const { return this->out != NULL; }
+
+  void record(uint8_t type, uint8_t xfer_type, uint8_t devnum, uint8_t epnum, uint64_t id, int64_t timestamp_us,
+              const uint8_t *setup, int32_t status, const uint8_t *data, uint16_t length, uint16_t requested, int32_t interval = 0);
+
+  // 制御転送のSubmit（setupパケット、OUT方向ならデータ付き）
+  void controlSubmit(uint8_t devnum, uint64_t id, const uint8_t *setup) {
+    uint16_t wLength = setup[6] | (setup[7] << 8);
+    bool in = setup[0] & 0x80;
+    record('S', USB_CAPTURE_XFER_CONTROL, devnum, in ? 0x80 : 0x00, id, esp_timer_get_time(), setup, -115 /* -EINPROGRESS */,
+           in ? NULL : setup + 8, in ? 0 : wLength, wLength);
+  }
+  // 制御転送のComplete（IN方向なら応答データ付き）
+  void controlComplete(uint8_t devnum, uint64_t id, bool in, int32_t status, const uint8_t *data, uint16_t length) {
+    record('C', USB_CAPTURE_XFER_CONTROL, devnum, in ? 0x80 : 0x00, id, esp_timer_get_time(), NULL, status,
+           in ? data : NULL, in ? length : 0, length);
+  }
+  // インタラプト転送のSubmit（IN方向なのでデータは無く、要求長だけ残る）
+  void interruptSubmit(uint8_t devnum, uint8_t epnum, uint64_t id, uint16_t requested, int32_t interval) {
+    record('S', USB_CAPTURE_XFER_INTERRUPT, devnum, epnum, id, esp_timer_get_time(), NULL, -115 /* -EINPROGRESS */,
+           NULL, 0, requested, interval);
+  }
+  // インタラプト転送のComplete
+  void interruptComplete(uint8_t devnum, uint8_t epnum, uint64_t id, int64_t timestamp_us, int32_t status, const uint8_t *data, uint16_t length, int32_t interval) {
+    record('C', USB_CAPTURE_XFER_INTERRUPT, devnum, epnum, id, timestamp_us, NULL, status, data, length, length, interval);
+  }
+
+  // ESP-IDFの転送ステータスをusbmonのstatus（負のerrno）へ変換
+  static int32_t transferStatus(usb_transfer_status_t status);
+
+  uint32_t droppedCount() const { return ring.overflowCount(); }
+
+private:
+  static void _drainTask(void *arg);
+  void _writeBlock(uint32_t type, const void *body, uint32_t body_length, const void *data, uint32_t data_length);
+  void _writePacket(const usb_capture_packet_t &packet);
+
+  SpscRing<usb_capture_packet_t, USB_CAPTURE_RING_SIZE> ring;
+  Print *out = NULL;
+  TaskHandle_t taskHandle = NULL;
+};
+
+#if USB_CAPTURE_ENABLED
+extern UsbCapture usbCapture;
+#endif
+
+#endif // USB_CAPTURE_H
@@ -0,0 +1,188 @@
+#include "UsbDescriptorCache.h"
+#if USB_DESC_CACHE_NVS
+#include <Preferences.h>
+#endif
+
+// NVSのキー名（エントリ番号ごと）
+static void cacheKeyName(char *name, uint8_t index) {
+  sprintf(name, "e%d", index);
+}
+
+void UsbDescriptorCache::begin() {
+  memset(entries, 0, sizeof(entries));
+  useCounter = 0;
+
+#if USB_DESC_CACHE_NVS
+  Preferences prefs;
+  if (!prefs.begin(USB_DESC_CACHE_NVS_NAMESPACE, true)) {
+    return;
+  }
+  for (uint8_t i = 0; i < USB_DESC_CACHE_ENTRIES; i++) {
+    char name[8];
+    cacheKeyName(name, i);
+    usb_desc_cache_entry_t &entry = entries[i];
+    if (prefs.getBytesLength(name) != sizeof(entry) || prefs.getBytes(name, &entry, sizeof(entry)) != sizeof(entry)) {
+      memset(&entry, 0, sizeof(entry));
+      continue;
+    }
+    // 保存形式が違う・壊れているものは読み捨てる
+    if (entry.version != USB_DESC_CACHE_VERSION || !entry.valid || entry.dataSize > USB_DESC_CACHE_DATA_SIZE) {
+      memset(&entry, 0, sizeof(entry));
+      continue;
+    }
+    if (entry.lastUsed > useCounter) {
+      useCounter = entry.lastUsed;
+    }
+    ESP_LOGI("EspUsbHost", "descriptor cache loaded e%d VID=%04x PID=%04x bcdDevice=%04x bytes=%d",
+             i, entry.key.idVendor, entry.key.idProduct, entry.key.bcdDevice, entry.dataSize);
+  }
+  prefs.end();
+#endif
+}
+
+uint32_t UsbDescriptorCache::hash(const uint8_t *data, uint16_t length) {
+  uint32_t h = 2166136261UL;
+  for (uint16_t i = 0; i < length; i++) {
+    h ^= data[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+usb_desc_cache_entry_t *UsbDescriptorCache::_find(const usb_desc_cache_key_t &key) {
+  for (uint8_t i = 0; i < USB_DESC_CACHE_ENTRIES; i++) {
+    if (entries[i].valid && entries[i].key.sameDevice(key)) {
+      return &entries[i];
+    }
+  }
+  return NULL;
+}
+
+bool UsbDescriptorCache::contains(const usb_desc_cache_key_t &key) {
+  usb_desc_cache_entry_t *entry = _find(key);
+  if (entry == NULL || entry->key.configHash != key.configHash) {
+    missCount++;
+    return false;
+  }
+  hitCount++;
+  entry->lastUsed = ++useCounter;
+  return true;
+}
+
+const uint8_t *UsbDescriptorCache::findReport(const usb_desc_cache_key_t &key, uint8_t bInterfaceNumber, uint16_t *length) {
+  usb_desc_cache_entry_t *entry = _find(key);
+  if (entry == NULL || entry->key.configHash != key.configHash) {
+    return NULL;
+  }
+
+  for (uint16_t pos = 0; pos + 3 <= entry->dataSize;) {
+    uint16_t size = entry->data[pos + 1] | (entry->data[pos + 2] << 8);
+    if (pos + 3 + size > entry->dataSize) {
+      break;
+    }
+    if (entry->data[pos] == bInterfaceNumber) {
+      *length = size;
+      return &entry->data[pos + 3];
+    }
+    pos += 3 + size;
+  }
+  return NULL;
+}
+
+usb_desc_cache_entry_t *UsbDescriptorCache::_alloc(const usb_desc_cache_key_t &key) {
+  // 同じデバイスの古い構成、空きエントリ、最も長く使っていないエントリの順に使う
+  usb_desc_cache_entry_t *entry = _find(key);
+  if (entry == NULL) {
+    for (uint8_t i = 0; i < USB_DESC_CACHE_ENTRIES; i++) {
+      if (!entries[i].valid) {
+        entry = &entries[i];
+        break;
+      }
+    }
+  }
+  if (entry == NULL) {
+    entry = &entries[0];
+    for (uint8_t i = 1; i < USB_DESC_CACHE_ENTRIES; i++) {
+      if (entries[i].lastUsed < entry->lastUsed) {
+        entry = &entries[i];
+      }
+    }
+  }
+
+  memset(entry, 0, sizeof(*entry));
+  entry->version = USB_DESC_CACHE_VERSION;
+  entry->valid = true;
+  entry->key = key;
+  return entry;
+}
+
+void UsbDescriptorCache::storeReport(const usb_desc_cache_key_t &key, uint8_t bInterfaceNumber, const uint8_t *desc, uint16_t length) {
+  uint16_t cached_length;
+  const uint8_t *cached = findReport(key, bInterfaceNumber, &cached_length);
+  if (cached != NULL && cached_length == length && memcmp(cached, desc, length) == 0) {
+    return;
+  }
+
+  usb_desc_cache_entry_t *entry = _find(key);
+  if (entry == NULL || entry->key.configHash != key.configHash) {
+    entry = _alloc(key);
+  } else if (cached != NULL) {
+    // 内容が変わったレコードは取り除いてから末尾に追加し直す
+    uint16_t pos = (cached - entry->data) - 3;
+    uint16_t size = 3 + cached_length;
+    memmove(&entry->data[pos], &entry->data[pos + size], entry->dataSize - pos - size);
+    entry->dataSize -= size;
+  }
+
+  if (entry->dataSize + 3 + length > USB_DESC_CACHE_DATA_SIZE) {
+    ESP_LOGI("EspUsbHost", "descriptor cache full bInterfaceNumber=%d length=%d", bInterfaceNumber, length);
+    return;
+  }
+
+  entry->data[entry->dataSize] = bInterfaceNumber;
+  entry->data[entry->dataSize + 1] = length & 0xff;
+  entry->data[entry->dataSize + 2] = length >> 8;
+  memcpy(&entry->data[entry->dataSize + 3], desc, length);
+  entry->dataSize += 3 + length;
+  entry->lastUsed = ++useCounter;
+
+  ESP_LOGI("EspUsbHost", "descriptor cache store VID=%04x PID=%04x bInterfaceNumber=%d length=%d",
+           key.idVendor, key.idProduct, bInterfaceNumber, length);
+  _save(entry);
+}
+
+void UsbDescriptorCache::_save(const usb_desc_cache_entry_t *entry) {
+#if USB_DESC_CACHE_NVS
+  // ここは制御転送の完了コールバック内なので、コピーを積むだけにしてNVSへはflush()で書く
+  usb_desc_cache_save_t *slot = saveQueue.acquire();
+  if (slot == NULL) {
+    saveDropped++;
+    ESP_LOGI("EspUsbHost", "descriptor cache save queue full, e%d stays RAM only", (int)(entry - entries));
+    return;
+  }
+  slot->index = entry - entries;
+  memcpy(&slot->entry, entry, sizeof(*entry));
+  saveQueue.commit();
+#endif
+}
+
+void UsbDescriptorCache::flush() {
+#if USB_DESC_CACHE_NVS
+  usb_desc_cache_save_t *slot = saveQueue.peek();
+  if (slot == NULL) {
+    return;
+  }
+  Preferences prefs;
+  if (prefs.begin(USB_DESC_CACHE_NVS_NAMESPACE, false)) {
+    char name[8];
+    cacheKeyName(name, slot->index);
+    if (prefs.putBytes(name, &slot->entry, sizeof(slot->entry)) != sizeof(slot->entry)) {
+      ESP_LOGI("EspUsbHost", "descriptor cache NVS write failed %s", name);
+    }
+    prefs.end();
+  } else {
+    ESP_LOGI("EspUsbHost", "descriptor cache NVS open failed");
+  }
+  saveQueue.release();
+#endif
+}
@@ -0,0 +1,82 @@
+#ifndef USB_DESCRIPTOR_CACHE_H
+#define USB_DESCRIPTOR_CACHE_H
+
+#include <Arduino.h>
+#include "SpscRing.h"
+
+// ディスクリプタキャッシュの設定（build_flagsで上書き可能）
+#ifndef USB_DESC_CACHE_ENTRIES
+#define USB_DESC_CACHE_ENTRIES 4        // 覚えておくデバイス数（超えたら最も古いものを捨てる）
+#endif
+#ifndef USB_DESC_CACHE_DATA_SIZE
+#define USB_DESC_CACHE_DATA_SIZE 512    // 1デバイス分のレポートディスクリプタ合計の上限（バイト）
+#endif
+#ifndef USB_DESC_CACHE_NVS
+#define USB_DESC_CACHE_NVS 1            // 1ならNVSにも保存し、電源を切っても保持する
+#endif
+#define USB_DESC_CACHE_NVS_NAMESPACE "usbdesc"
+#define USB_DESC_CACHE_SAVE_QUEUE 2     // NVS書き込み待ちのエントリ数（2のべき乗）
+#define USB_DESC_CACHE_VERSION 1        // 保存形式を変えたら上げる（古い形式は読み捨てる）
+
+// デバイスの識別キー（構成ディスクリプタのハッシュが違えばファームウェア更新等とみなして使わない）
+struct usb_desc_cache_key_t {
+  uint16_t idVendor;
+  uint16_t idProduct;
+  uint16_t bcdDevice;
+  uint32_t serialHash;   // シリアル番号文字列のハッシュ（なければ0）
+  uint32_t configHash;   // 構成ディスクリプタ全体のハッシュ
+
+  bool sameDevice(const usb_desc_cache_key_t &other) const {
+    return idVendor == other.idVendor && idProduct == other.idProduct && bcdDevice == other.bcdDevice && serialHash == other.serialHash;
+  }
+};
+
+// 1デバイス分のキャッシュ
+// data[]には [bInterfaceNumber(1) 長さ(2) レポートディスクリプタ] のレコードを詰めて並べる
+struct usb_desc_cache_entry_t {
+  uint8_t version;
+  bool valid;
+  usb_desc_cache_key_t key;
+  uint32_t lastUsed;     // 置き換え順（大きいほど最近使った）
+  uint16_t dataSize;
+  uint8_t data[USB_DESC_CACHE_DATA_SIZE];
+};
+
+// NVSへの書き込み待ち（エントリのコピーと保存先の番号）
+struct usb_desc_cache_save_t {
+  uint8_t index;
+  usb_desc_cache_entry_t entry;
+};
+
+// 接続し直したデバイスのレポートディスクリプタを、制御転送で取り直さずにRAM/NVSから引くためのキャッシュ
+// flush()以外の呼び出しはすべてUSBクライアントタスク（列挙処理）から行う
+class UsbDescriptorCache {
+public:
+  void begin();
+  // 書き込み待ちのエントリを1件NVSへ保存する（loop()から呼ぶ、USBタスクをフラッシュ書き込みで止めないため）
+  void flush();
+  // キーが完全に一致するデバイスがあるか
+  bool contains(const usb_desc_cache_key_t &key);
+  // インターフェースのレポートディスクリプタ（なければNULL）
+  const uint8_t *findReport(const usb_desc_cache_key_t &key, uint8_t bInterfaceNumber, uint16_t *length);
+  // レポートディスクリプタを登録（同じ内容なら何もしない、変わっていればNVSも更新）
+  void storeReport(const usb_desc_cache_key_t &key, uint8_t bInterfaceNumber, const uint8_t *desc, uint16_t length);
+
+  // 32ビットFNV-1a（キーのハッシュ用）
+  static uint32_t hash(const uint8_t *data, uint16_t length);
+
+  uint32_t hitCount = 0;
+  uint32_t missCount = 0;
+  uint32_t saveDropped = 0;  // 書き込み待ちが満杯で保存できなかった回数
+
+private:
+  usb_desc_cache_entry_t *_find(const usb_desc_cache_key_t &key);
+  usb_desc_cache_entry_t *_alloc(const usb_desc_cache_key_t &key);
+  void _save(const usb_desc_cache_entry_t *entry);
+
+  usb_desc_cache_entry_t entries[USB_DESC_CACHE_ENTRIES] = {};
+  uint32_t useCounter = 0;
+  SpscRing<usb_desc_cache_save_t, USB_DESC_CACHE_SAVE_QUEUE> saveQueue;
+};
+
+#endif // USB_DESCRIPTOR_CACHE_H